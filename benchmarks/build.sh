@@ -0,0 +1,37 @@
+#!/bin/bash
+
+# Builds the benchmarks in this directory (one executable per .cpp file) into build/benchmarks.
+# They're not part of the library build (CMake only picks up the library sources); run them by hand,
+# on an otherwise idle machine.
+
+cd "$(dirname "$0")"
+
+BUILD_DIR="../build/benchmarks"
+CXXFLAGS="-std=c++17 -O2 -pthread"
+if [[ "$OSTYPE" != "darwin"* ]]; then
+	CXXFLAGS="$CXXFLAGS -march=x86-64"
+fi
+
+mkdir -p $BUILD_DIR/obj
+
+# the utils sources are compiled once and linked into every benchmark
+OBJECTS=""
+for src in ../fosscppfw/utils/*.cpp; do
+	obj="$BUILD_DIR/obj/$(basename ${src%.cpp}).o"
+	g++ $CXXFLAGS -c $src -o $obj
+	if [[ $? != 0 ]]; then
+		printf "\n Errors encountered. \n\n"
+		exit 1
+	fi
+	OBJECTS="$OBJECTS $obj"
+done
+
+for bench in *.cpp; do
+	g++ $CXXFLAGS $bench $OBJECTS -o "$BUILD_DIR/${bench%.cpp}"
+	if [[ $? != 0 ]]; then
+		printf "\n Errors encountered. \n\n"
+		exit 1
+	fi
+done
+
+printf "\n Success: the benchmarks are in $BUILD_DIR\n\n"
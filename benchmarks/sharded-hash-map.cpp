@@ -0,0 +1,118 @@
+/*
+ * sharded-hash-map.cpp
+ *
+ *  Throughput of ShardedHashMap against LocklessMTMap (and RcuMTMap) with several threads doing random lookups and
+ *  setIfGreater() writes on a pre-filled map, for a range of write ratios. Each run lasts a fixed time, since the
+ *  maps' speeds differ by orders of magnitude once there are writes.
+ *  Build with build.sh; optional arguments: thread count, key count, milliseconds per run.
+ */
+
+#include "../fosscppfw/utils/lockless-mt-map.h"
+#include "../fosscppfw/utils/rcu-mt-map.h"
+#include "../fosscppfw/utils/sharded-hash-map.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+
+unsigned threadCount = 4;
+int keyCount = 50000;
+std::chrono::milliseconds runTime { 500 };
+
+// Runs threadCount threads for runTime; each one calls makeOps() once and then op(key, isWrite, i) over random keys,
+// with writePercent of the calls being writes. Returns millions of operations per second.
+template<class MAKEOPS>
+double run(int writePercent, MAKEOPS makeOps) {
+	std::atomic<bool> stop { false };
+	std::atomic<long> totalOps { 0 };
+	std::vector<std::thread> threads;
+	auto t0 = std::chrono::steady_clock::now();
+	for (unsigned t=0; t<threadCount; t++)
+		threads.emplace_back([&, t] {
+			auto op = makeOps();	// per-thread state, such as a map View
+			std::mt19937 rng(t + 1);
+			long i = 0;
+			for (; !stop.load(std::memory_order_relaxed); i++) {
+				int key = rng() % keyCount;
+				op(key, (int)(rng() % 100) < writePercent, i);
+			}
+			totalOps.fetch_add(i);
+		});
+	std::this_thread::sleep_for(runTime);
+	stop.store(true);
+	for (auto &t : threads)
+		t.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	return totalOps.load() / seconds / 1e6;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	if (argc > 1)
+		threadCount = std::strtoul(argv[1], nullptr, 10);
+	if (argc > 2)
+		keyCount = std::strtol(argv[2], nullptr, 10);
+	if (argc > 3)
+		runTime = std::chrono::milliseconds(std::strtol(argv[3], nullptr, 10));
+	printf("%u threads, %d keys, Mops/s:\n", threadCount, keyCount);
+	printf("%8s %14s %14s %14s\n", "writes", "LocklessMTMap", "RcuMTMap", "ShardedHashMap");
+
+	for (int writePercent : {0, 1, 10, 50, 90}) {
+		double lockless, rcu, sharded;
+		{
+			LocklessMTMap<int, long> map;
+			{
+				LocklessMTMap<int, long>::View view(map);
+				for (int k=0; k<keyCount; k++)
+					view.setIfGreater(k, 0);
+			}
+			lockless = run(writePercent, [&] {
+				return [view = std::make_shared<LocklessMTMap<int, long>::View>(map)](int key, bool write, long i) {
+					if (write)
+						view->setIfGreater(key, i);
+					else
+						view->get(key);
+				};
+			});
+		}
+		{
+			RcuMTMap<int, long> map;
+			{
+				RcuMTMap<int, long>::View view(map);
+				for (int k=0; k<keyCount; k++)
+					view.setIfGreater(k, 0);
+			}
+			rcu = run(writePercent, [&] {
+				return [view = std::make_shared<RcuMTMap<int, long>::View>(map)](int key, bool write, long i) {
+					if (write)
+						view->setIfGreater(key, i);
+					else
+						view->get(key);
+				};
+			});
+		}
+		{
+			ShardedHashMap<int, long> map;
+			for (int k=0; k<keyCount; k++)
+				map.setIfGreater(k, 0);
+			sharded = run(writePercent, [&] {
+				return [&map](int key, bool write, long i) {
+					long value;
+					if (write)
+						map.setIfGreater(key, i);
+					else
+						map.get(key, value);
+				};
+			});
+		}
+		printf("%7d%% %14.3f %14.3f %14.3f\n", writePercent, lockless, rcu, sharded);
+	}
+	return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * spsc-channel.cpp
+ *
+ *  Throughput of a one producer / one consumer hand-off through AsyncQueue (mutex and ring backends) and
+ *  SPSCChannel (blocking push/pop, and in-place reserve/commit + peek/consume), plus the same with string payloads.
+ *  Build with build.sh; optional argument: item count.
+ */
+
+#include "../fosscppfw/utils/async-queue.h"
+#include "../fosscppfw/utils/spsc-channel.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <thread>
+
+namespace {
+
+long itemCount = 5000000;
+
+// runs produce() on a new thread and consume() (which returns the sum of what it received) on this one
+template<class PRODUCE, class CONSUME>
+void run(const char* name, PRODUCE produce, CONSUME consume) {
+	auto t0 = std::chrono::steady_clock::now();
+	std::thread producer(produce);
+	long sum = consume();
+	producer.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	printf("%-32s %8.2f Mitems/s%s\n", name, itemCount / seconds / 1e6,
+		sum == itemCount * (itemCount - 1) / 2 ? "" : "  (WRONG SUM)");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+	if (argc > 1)
+		itemCount = std::strtol(argv[1], nullptr, 10);
+	printf("%ld items, 1 producer, 1 consumer\n", itemCount);
+
+	{
+		AsyncQueue<long> q;
+		run("AsyncQueue (mutex) push/pop", [&] {
+			for (long i=0; i<itemCount; i++)
+				q.push(long(i));
+		}, [&] {
+			long sum = 0;
+			for (long i=0; i<itemCount; i++)
+				sum += q.pop();
+			return sum;
+		});
+	}
+	{
+		AsyncRingQueue<long> q;
+		run("AsyncRingQueue push/pop", [&] {
+			for (long i=0; i<itemCount; i++)
+				q.push(long(i));
+		}, [&] {
+			long sum = 0;
+			for (long i=0; i<itemCount; i++)
+				sum += q.pop();
+			return sum;
+		});
+	}
+	{
+		SPSCChannel<long> ch(1024);
+		run("SPSCChannel push/pop", [&] {
+			for (long i=0; i<itemCount; i++)
+				ch.push(long(i));
+		}, [&] {
+			long sum = 0;
+			for (long i=0; i<itemCount; i++)
+				sum += ch.pop();
+			return sum;
+		});
+	}
+	{
+		// the zero-copy path, yielding while the channel is full / empty
+		SPSCChannel<long> ch(1024);
+		run("SPSCChannel reserve/peek", [&] {
+			for (long i=0; i<itemCount; i++) {
+				void* slot;
+				while (!(slot = ch.reserve()))
+					std::this_thread::yield();
+				new (slot) long(i);
+				ch.commit();
+			}
+		}, [&] {
+			long sum = 0;
+			for (long i=0; i<itemCount; i++) {
+				long* p;
+				while (!(p = ch.peek()))
+					std::this_thread::yield();
+				sum += *p;
+				ch.consume();
+			}
+			return sum;
+		});
+	}
+
+	// payloads that own memory: what the AMQP thread hands to its parser
+	{
+		AsyncQueue<std::string> q;
+		run("AsyncQueue (mutex) strings", [&] {
+			for (long i=0; i<itemCount; i++)
+				q.push(std::to_string(i));
+		}, [&] {
+			long sum = 0;
+			for (long i=0; i<itemCount; i++)
+				sum += std::stol(q.pop());
+			return sum;
+		});
+	}
+	{
+		SPSCChannel<std::string> ch(1024);
+		run("SPSCChannel strings (emplace)", [&] {
+			for (long i=0; i<itemCount; i++)
+				ch.emplace(std::to_string(i));
+		}, [&] {
+			long sum = 0;
+			for (long i=0; i<itemCount; i++)
+				sum += std::stol(ch.pop());
+			return sum;
+		});
+	}
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * thread-pool-submit.cpp
+ *
+ *  Cost of submitting tiny tasks to a ThreadPool through queueTask() (with a handle) and queueDetached()
+ *  (fire-and-forget), in both pool modes: time per task and heap allocations per task. "queueTask big" captures
+ *  more than THREADPOOL_TASK_INLINE_SIZE, so it takes the callable's heap fallback: that's the allocating path.
+ *  Build with build.sh; optional arguments: task count, worker count.
+ */
+
+#include "../fosscppfw/utils/ThreadPool.h"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<size_t> allocations { 0 };
+}
+
+// counts every heap allocation in the process (the workers' included)
+void* operator new(size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+	std::free(p);
+}
+
+template<class SUBMIT>
+void run(const char* name, ThreadPool::Mode mode, unsigned workers, size_t taskCount, SUBMIT submit) {
+	ThreadPool pool(workers, 1000, mode);
+	std::atomic<size_t> done { 0 };
+	// warm up the task freelist, so that what's measured is the steady state
+	for (size_t i=0; i<taskCount / 10; i++)
+		submit(pool, done);
+	pool.wait();
+	done.store(0);
+
+	size_t allocsBefore = allocations.load();
+	auto t0 = std::chrono::steady_clock::now();
+	for (size_t i=0; i<taskCount; i++)
+		submit(pool, done);
+	pool.wait();
+	auto t1 = std::chrono::steady_clock::now();
+	size_t allocs = allocations.load() - allocsBefore;
+	pool.stop();
+
+	double ns = std::chrono::duration<double, std::nano>(t1 - t0).count() / taskCount;
+	printf("%-14s %-13s %8.1f ns/task %8.3f allocs/task%s\n", name,
+		mode == ThreadPool::Mode::SharedQueue ? "SharedQueue" : "WorkStealing", ns, (double)allocs / taskCount,
+		done.load() == taskCount ? "" : "  (WRONG TASK COUNT)");
+}
+
+int main(int argc, char** argv) {
+	size_t taskCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 1000000;
+	unsigned workers = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4;
+	printf("%zu tasks, %u workers, queue limit 1000\n", taskCount, workers);
+
+	for (auto mode : {ThreadPool::Mode::SharedQueue, ThreadPool::Mode::WorkStealing}) {
+		run("queueTask", mode, workers, taskCount, [](ThreadPool &pool, std::atomic<size_t> &done) {
+			pool.queueTask([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+		});
+		run("queueTask big", mode, workers, taskCount, [](ThreadPool &pool, std::atomic<size_t> &done) {
+			std::array<char, 128> payload {};
+			pool.queueTask([&done, payload] { done.fetch_add(1 + payload[0], std::memory_order_relaxed); });
+		});
+		run("queueDetached", mode, workers, taskCount, [](ThreadPool &pool, std::atomic<size_t> &done) {
+			pool.queueDetached([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+		});
+	}
+	return 0;
+}
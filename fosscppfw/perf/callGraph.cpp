@@ -14,6 +14,7 @@
 namespace perf {
 
 thread_local std::shared_ptr<CallGraph> CallGraph::crtThreadInstance_;
+std::atomic<bool> CallGraph::recordingEnabled_ { true };
 
 CallGraph& CallGraph::getCrtThreadInstance() {
 	if (!crtThreadInstance_) {
@@ -23,40 +24,150 @@ CallGraph& CallGraph::getCrtThreadInstance() {
 	return *crtThreadInstance_;
 }
 
-void CallGraph::pushSection(const char name[], bool deadTime) {
+CallGraph::~CallGraph() {
+	for (unsigned id=0; id<flatSize_.load(std::memory_order_relaxed); id++)
+		if (auto p = flatSectionData_.tryGet(id))
+			delete p->load(std::memory_order_relaxed);
+}
+
+void CallGraph::pushSection(unsigned sectionId, bool deadTime) {
+	auto &graph = getCrtThreadInstance();
 	// add to call-trees:
-	std::vector<std::shared_ptr<sectionData>> &treeContainer =
-		getCrtThreadInstance().crtStack_.empty()
-			? getCrtThreadInstance().rootTrees_
-			: getCrtThreadInstance().crtStack_.top()->callees_;
-	auto treeIt = std::find_if(treeContainer.begin(), treeContainer.end(), [&name] (auto &sec) {
-		return !std::strncmp(sec->name_, name, sizeof(sec->name_) / sizeof(sec->name_[0]) - 1);
-	});
-	if (treeIt == treeContainer.end()) {
-		treeContainer.emplace_back(sectionData::make_shared(name));
-		treeIt = treeContainer.end()-1;
+	unsigned parent = graph.crtStack_.empty() ? noNode : graph.crtStack_.back().index;
+	unsigned index = graph.children_.find(parent, sectionId);
+	if (index == noNode) {
+		index = graph.allocNode(sectionId, parent);
+		graph.children_.insert(parent, sectionId, index);
 	}
-	(*treeIt)->deadTime_ = deadTime;
-	getCrtThreadInstance().crtStack_.push(treeIt->get());
+	treeNode &node = graph.nodes_.at(index);
+	node.deadTime.store(deadTime, std::memory_order_relaxed);
+	graph.crtStack_.push_back({ &node, index });
 }
 
 void CallGraph::popSection(uint64_t nanoseconds) {
-	auto &stack = getCrtThreadInstance().crtStack_;
-	// add time to secion, ++callCount
-	sectionData *pCrt = stack.top();
-	pCrt->executionCount_++;
-	pCrt->nanoseconds_ += nanoseconds;
-	stack.pop();
+	auto &graph = getCrtThreadInstance();
+	treeNode &crt = *graph.crtStack_.back().node;
+	graph.crtStack_.pop_back();
+	treeNode* parent = graph.crtStack_.empty() ? nullptr : graph.crtStack_.back().node;
+
+	auto &flatPtr = graph.flatSectionData_.at(crt.sectionId);
+	flatTotals* flat = flatPtr.load(std::memory_order_relaxed);
+	if (!flat) {
+		flat = new flatTotals();
+		flatPtr.store(flat, std::memory_order_release);
+		if (crt.sectionId >= graph.flatSize_.load(std::memory_order_relaxed))
+			graph.flatSize_.store(crt.sectionId + 1, std::memory_order_release);
+	}
 
+	unsigned seq = graph.seq_.load(std::memory_order_relaxed);
+	graph.seq_.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	// add time to secion, ++callCount
+	add(crt.executionCount, uint64_t(1));
+	add(crt.nanoseconds, nanoseconds);
+	if (parent)
+		add(parent->calleeNanoseconds, nanoseconds);
 	// add time to flat list:
-	auto &flatList = getCrtThreadInstance().flatSectionData_;
+	add(flat->executionCount, uint64_t(1));
+	add(flat->nanoseconds, nanoseconds);
+	flat->histogram.record(nanoseconds);
+	graph.seq_.store(seq + 2, std::memory_order_release);
+}
+
+unsigned CallGraph::allocNode(unsigned sectionId, unsigned parent) {
+	unsigned index = nodeCount_.load(std::memory_order_relaxed);
+	treeNode &n = nodes_.at(index);
+	n.sectionId = sectionId;
+	n.parent = parent;
+	auto &first = parent == noNode ? firstRoot_ : nodes_.at(parent).firstCallee;
+	n.nextSibling.store(first.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	// publish: a reader that finds the index in a link sees the node initialized
+	nodeCount_.store(index + 1, std::memory_order_release);
+	first.store(index, std::memory_order_release);
+	return index;
+}
+
+template<class F>
+void CallGraph::readConsistent(F f) const {
+	for (int attempt=0; attempt<16; attempt++) {
+		unsigned seq = seq_.load(std::memory_order_acquire);
+		if (seq & 1)
+			continue;
+		f();
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (seq_.load(std::memory_order_relaxed) == seq)
+			return;
+	}
+	f();
+}
+
+std::vector<std::shared_ptr<sectionData>> CallGraph::exportTrees(unsigned first) const {
+	std::vector<std::shared_ptr<sectionData>> ret;
+	for (unsigned i = first; i != noNode; ) {
+		treeNode &n = *nodes_.tryGet(i);
+		std::shared_ptr<sectionData> s(new sectionData(n.sectionId));
+		readConsistent([&] {
+			s->nanoseconds_ = n.nanoseconds.load(std::memory_order_relaxed);
+			s->calleeNanoseconds_ = n.calleeNanoseconds.load(std::memory_order_relaxed);
+			s->executionCount_ = n.executionCount.load(std::memory_order_relaxed);
+		});
+		s->deadTime_ = n.deadTime.load(std::memory_order_relaxed);
+		s->callees_ = exportTrees(n.firstCallee.load(std::memory_order_acquire));
+		ret.push_back(std::move(s));
+		i = n.nextSibling.load(std::memory_order_relaxed);
+	}
+	return ret;
+}
+
+std::vector<sectionData> CallGraph::exportFlatList() const {
+	std::vector<sectionData> ret;
+	unsigned size = flatSize_.load(std::memory_order_acquire);
+	for (unsigned id=0; id<size; id++) {
+		auto p = flatSectionData_.tryGet(id);
+		flatTotals* flat = p ? p->load(std::memory_order_acquire) : nullptr;
+		if (!flat)
+			continue;
+		sectionData s(id);
+		s.histogram_ = std::make_shared<LatencyHistogram>();
+		readConsistent([&] {
+			s.nanoseconds_ = flat->nanoseconds.load(std::memory_order_relaxed);
+			s.executionCount_ = flat->executionCount.load(std::memory_order_relaxed);
+			*s.histogram_ = flat->histogram;
+		});
+		if (s.executionCount_)
+			ret.push_back(std::move(s));
+	}
+	return ret;
+}
+
+unsigned CallGraph::childTable::find(unsigned parent, unsigned id) const {
+	if (entries_.empty())
+		return noNode;
+	size_t mask = entries_.size() - 1;
+	for (size_t i = hashOf(parent, id) & mask; entries_[i].child != noNode; i = (i + 1) & mask)
+		if (entries_[i].parent == parent && entries_[i].id == id)
+			return entries_[i].child;
+	return noNode;
+}
 
-	auto it = flatList.find(pCrt->name_);
-	if (it == flatList.end()) {
-		it = flatList.emplace(pCrt->name_, sectionData::make_unique(pCrt->name_)).first;
+void CallGraph::childTable::insert(unsigned parent, unsigned id, unsigned child) {
+	if ((size_ + 1) * 2 > entries_.size()) {
+		// keep the load under 50%
+		std::vector<entry> old(std::max<size_t>(64, entries_.size() * 2));
+		old.swap(entries_);
+		size_ = 0;
+		for (auto &e : old)
+			if (e.child != noNode)
+				insert(e.parent, e.id, e.child);
 	}
-	it->second->executionCount_++;
-	it->second->nanoseconds_ += nanoseconds;
+	size_t mask = entries_.size() - 1;
+	size_t i = hashOf(parent, id) & mask;
+	while (entries_[i].child != noNode)
+		i = (i + 1) & mask;
+	entries_[i].parent = parent;
+	entries_[i].id = id;
+	entries_[i].child = child;
+	size_++;
 }
 
 } // namespace
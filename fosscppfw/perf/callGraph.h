@@ -8,24 +8,38 @@
 
 #ifdef ENABLE_PERF_PROFILING
 
+#include "histogram.h"
 #include "section.h"
+#include "sectionNames.h"
 
+#include <atomic>
 #include <string>
-#include <stack>
-#include <unordered_map>
+#include <vector>
 #include <memory>
+#include <mutex>
 
 namespace perf {
 
 class CallGraph {
 public:
-	static void pushSection(const char name[], bool deadTime);
+	static void pushSection(unsigned sectionId, bool deadTime);
 	static void popSection(uint64_t nanoseconds);
 
+	// Turns timing and accumulating the call graph on or off for all threads (it's on by default). Markers that are
+	// already open when it changes finish in the state they started in.
+	static void setRecordingEnabled(bool enabled) {
+		recordingEnabled_.store(enabled, std::memory_order_relaxed);
+	}
+	static bool recordingEnabled() {
+		return recordingEnabled_.load(std::memory_order_relaxed);
+	}
+
 	static std::string getCrtThreadName() {
-		return getCrtThreadInstance().threadName_;
+		return getCrtThreadInstance().getThreadName();
 	}
 
+	~CallGraph();
+
 private:
 	friend class Results;
 	friend void setCrtThreadName(std::string name);
@@ -33,29 +47,135 @@ private:
 	CallGraph() {}
 	static CallGraph& getCrtThreadInstance();
 
-	struct charArrHash {
-		size_t operator()(const char* s) const {
-			size_t h = 5381;
-			int c;
-			const char* s0 = s;
-			while ((c = *s0++))
-				h = ((h << 5) + h) + c;
-			return h;
+	static constexpr unsigned noNode = ~0u;
+
+	/*
+	 * Everything below is written only by the thread that owns the graph, and may be read by any thread (Results)
+	 * meanwhile: the storage never moves, counters and links are atomics that the owner updates with plain relaxed
+	 * loads and stores, and new nodes are linked in with a release store after they're initialized.
+	 * popSection() updates the counters inside a seqlock (seq_ is odd meanwhile), so that readers can copy all the
+	 * counters of a node or a section from the same moment.
+	 */
+
+	// single writer: a plain load and store, no read-modify-write
+	template<class T>
+	static void add(std::atomic<T> &counter, T n) {
+		counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	// call-tree node; nodes live in a per-thread arena and link to each other by index
+	struct treeNode {
+		unsigned sectionId;
+		unsigned parent;
+		std::atomic<unsigned> firstCallee { noNode };
+		std::atomic<unsigned> nextSibling { noNode };
+		std::atomic<bool> deadTime { false };
+		std::atomic<uint64_t> nanoseconds { 0 };
+		std::atomic<uint64_t> calleeNanoseconds { 0 };	// the callees' inclusive time, added up as they finish
+		std::atomic<uint64_t> executionCount { 0 };
+	};
+
+	// cummulated data for a section, regardless of where it was called from
+	struct flatTotals {
+		std::atomic<uint64_t> nanoseconds { 0 };
+		std::atomic<uint64_t> executionCount { 0 };
+		LatencyHistogram histogram;
+	};
+
+	// Array that grows in segments that never move: segment k holds (firstSegmentSize << k) elements, and is allocated
+	// by the owner when first needed. Readers get nullptr for elements whose segment doesn't exist yet.
+	template<class T, unsigned firstSegmentBits>
+	class segmentedArray {
+	public:
+		~segmentedArray() {
+			for (auto &seg : segments_)
+				delete[] seg.load(std::memory_order_relaxed);
+		}
+		// owner only
+		T& at(unsigned index) {
+			unsigned offset, k = locate(index, offset);
+			T* seg = segments_[k].load(std::memory_order_relaxed);
+			if (!seg) {
+				seg = new T[size_t(1) << (firstSegmentBits + k)]();
+				segments_[k].store(seg, std::memory_order_release);
+			}
+			return seg[offset];
+		}
+		T* tryGet(unsigned index) const {
+			unsigned offset, k = locate(index, offset);
+			T* seg = segments_[k].load(std::memory_order_acquire);
+			return seg ? seg + offset : nullptr;
+		}
+	private:
+		std::atomic<T*> segments_[33 - firstSegmentBits] {};
+
+		static unsigned locate(unsigned index, unsigned &offset) {
+			uint64_t i = (uint64_t)index + (1u << firstSegmentBits);
+			unsigned k = 63 - __builtin_clzll(i) - firstSegmentBits;
+			offset = (unsigned)(i - (uint64_t(1) << (firstSegmentBits + k)));
+			return k;
+		}
+	};
+
+	// open-addressing map from (parent node, section id) to the child node, so that entering a section costs the same
+	// regardless of how many siblings it has (parent is noNode for the roots); owner only
+	class childTable {
+	public:
+		unsigned find(unsigned parent, unsigned id) const;
+		void insert(unsigned parent, unsigned id, unsigned child);
+	private:
+		struct entry {
+			unsigned parent;
+			unsigned id;
+			unsigned child = noNode;	// noNode marks an empty entry
+		};
+		std::vector<entry> entries_;
+		size_t size_ = 0;
+
+		static size_t hashOf(unsigned parent, unsigned id) {
+			uint64_t h = ((uint64_t)parent << 32 | id) * 0x9e3779b97f4a7c15ull;
+			return h ^ (h >> 29);
 		}
 	};
 
-	std::string threadName_;
+	struct stackEntry {
+		treeNode* node;
+		unsigned index;
+	};
 
-	// this structure holds cummulated data for each section
-	// (if a section is called from multiple other sections, all the timings here are aggregate)
-	std::unordered_map<const char*, std::unique_ptr<sectionData>, charArrHash> flatSectionData_;
+	unsigned allocNode(unsigned sectionId, unsigned parent);
 
-	// this holds call-tree data - a section with the same name may exist in multiple instances if called from different places
-	std::vector<std::shared_ptr<sectionData>> rootTrees_;
+	// reads f() repeatedly until it ran without popSection() updating the counters meanwhile
+	// (gives up after a few tries on a very busy thread, and keeps the last, almost consistent, result)
+	template<class F>
+	void readConsistent(F f) const;
 
-	std::stack<sectionData*> crtStack_;
+	// builds the sectionData trees for the node at first and all its following siblings
+	std::vector<std::shared_ptr<sectionData>> exportTrees(unsigned first) const;
+	std::vector<sectionData> exportFlatList() const;
+
+	std::string getThreadName() const {
+		std::lock_guard<std::mutex> lk(nameMutex_);
+		return threadName_;
+	}
+
+	std::string threadName_;	// guarded by nameMutex_
+	mutable std::mutex nameMutex_;
+
+	segmentedArray<treeNode, 10> nodes_;
+	std::atomic<unsigned> nodeCount_ { 0 };
+	std::atomic<unsigned> firstRoot_ { noNode };	// the roots are siblings of each other
+	childTable children_;
+	std::vector<stackEntry> crtStack_;
+	std::atomic<unsigned> seq_ { 0 };
+
+	// this structure holds cummulated data for each section, indexed by section id
+	// (if a section is called from multiple other sections, all the timings here are aggregate)
+	segmentedArray<std::atomic<flatTotals*>, 6> flatSectionData_;	// allocated when the section is first seen
+	std::atomic<unsigned> flatSize_ { 0 };	// 1 + the highest section id seen on this thread
 
 	static thread_local std::shared_ptr<CallGraph> crtThreadInstance_;
+	static std::atomic<bool> recordingEnabled_;
 };
 
 } // namespace
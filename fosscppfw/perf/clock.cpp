@@ -0,0 +1,75 @@
+/*
+ * clock.cpp
+ *
+ *  TSC detection and calibration for perf::Clock.
+ */
+#ifdef ENABLE_PERF_PROFILING
+
+#include "./clock.h"
+
+#ifdef PERF_CLOCK_TSC
+	#include <cpuid.h>
+#endif
+
+namespace perf {
+
+uint64_t Clock::tscBase_ = 0;
+int64_t Clock::nanosecBase_ = 0;
+std::atomic<uint64_t> Clock::tscMultiplier_ { 0 };
+uint64_t Clock::tscFrequency_ = 0;
+
+#ifdef PERF_CLOCK_TSC
+static void cpuid(unsigned leaf, unsigned regs[4]) {
+	__cpuid(leaf, regs[0], regs[1], regs[2], regs[3]);
+}
+
+// the TSC must tick at a constant rate regardless of power states (invariant TSC), and rdtscp must be available
+static bool hasInvariantTSC() {
+	unsigned regs[4];
+	cpuid(0x80000000, regs);
+	if (regs[0] < 0x80000007)
+		return false;
+	cpuid(0x80000001, regs);
+	bool rdtscp = regs[3] & (1u << 27);
+	cpuid(0x80000007, regs);
+	bool invariant = regs[3] & (1u << 8);
+	return rdtscp && invariant;
+}
+
+// calibrate()'s state: it measures the TSC against the fallback clock between its first call and the first one at
+// least calibrationInterval later; 10 ms give a frequency within a few ppm
+static constexpr int64_t calibrationInterval = 10000000;
+static std::atomic<bool> calibrationOver { false };	// calibrated, or there's no invariant TSC
+static std::atomic_flag calibrating = ATOMIC_FLAG_INIT;	// guards the two below; the threads that miss it just go on
+static int64_t startNanosec = 0;	// 0 until the first sample
+static uint64_t startTSC = 0;
+
+int64_t Clock::calibrate() noexcept {
+	int64_t ns = fallbackNanosec();
+	if (calibrationOver.load(std::memory_order_acquire) || calibrating.test_and_set(std::memory_order_acquire))
+		return ns;
+	if (!calibrationOver.load(std::memory_order_relaxed)) {
+		unsigned aux;
+		if (!startNanosec) {
+			if (hasInvariantTSC()) {
+				startNanosec = ns;
+				startTSC = __rdtscp(&aux);
+			} else
+				calibrationOver.store(true, std::memory_order_release);
+		} else if (uint64_t tsc = __rdtscp(&aux); ns - startNanosec >= calibrationInterval && tsc > startTSC) {
+			tscFrequency_ = (uint64_t)((unsigned __int128)(tsc - startTSC) * 1000000000 / (uint64_t)(ns - startNanosec));
+			tscBase_ = tsc;
+			nanosecBase_ = ns;
+			tscMultiplier_.store((uint64_t)(((unsigned __int128)(ns - startNanosec) << tscShift) / (tsc - startTSC)),
+				std::memory_order_release);
+			calibrationOver.store(true, std::memory_order_release);
+		}
+	}
+	calibrating.clear(std::memory_order_release);
+	return ns;
+}
+#endif
+
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
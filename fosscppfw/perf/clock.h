@@ -0,0 +1,97 @@
+/*
+ * clock.h
+ *
+ *  Time source for the perf markers.
+ *
+ *  On x86-64 CPUs with an invariant TSC, Clock::now() reads the time stamp counter (rdtscp, a few ns) and scales it
+ *  to nanoseconds with a multiplier calibrated against CLOCK_MONOTONIC_RAW. Without an invariant TSC (or when built
+ *  with PERF_DISABLE_TSC) it falls back to clock_gettime(CLOCK_MONOTONIC_RAW), or to std::chrono::steady_clock where
+ *  that isn't available.
+ *  The calibration is lazy and doesn't block: the first now() call samples both clocks, and the first one at least
+ *  10 ms later computes the multiplier; until then now() returns the fallback clock. So programs that link perf but
+ *  don't time anything pay nothing at startup. Both backends count nanoseconds from the same origin, so time points
+ *  taken before calibration finished can still be compared to later ones.
+ */
+#pragma once
+
+#ifdef ENABLE_PERF_PROFILING
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#if !defined(PERF_DISABLE_TSC) && defined(__x86_64__) && defined(__GNUC__)
+	#define PERF_CLOCK_TSC
+	#include <x86intrin.h>
+#endif
+
+#if !defined(__WIN32__) && !defined(WIN32)
+	#include <time.h>
+	#ifdef CLOCK_MONOTONIC_RAW
+		#define PERF_CLOCK_MONOTONIC_RAW
+	#endif
+#endif
+
+namespace perf {
+
+// a std::chrono compatible clock
+class Clock {
+public:
+	using rep = int64_t;
+	using period = std::nano;
+	using duration = std::chrono::nanoseconds;
+	using time_point = std::chrono::time_point<Clock>;
+	static constexpr bool is_steady = true;
+
+	static time_point now() noexcept {
+		return time_point(duration(nowNanosec()));
+	}
+
+	static int64_t nowNanosec() noexcept {
+#ifdef PERF_CLOCK_TSC
+		// acquire: tscBase_ and nanosecBase_ are written before the multiplier is published
+		if (uint64_t multiplier = tscMultiplier_.load(std::memory_order_acquire)) {
+			unsigned aux;
+			uint64_t ticks = __rdtscp(&aux) - tscBase_;
+			return nanosecBase_ + (int64_t)(((unsigned __int128)ticks * multiplier) >> tscShift);
+		}
+		return calibrate();
+#else
+		return fallbackNanosec();
+#endif
+	}
+
+	// true if now() reads the TSC (the CPU has an invariant TSC and calibration has finished)
+	static bool usingTSC() { return tscMultiplier_.load(std::memory_order_acquire) != 0; }
+
+	// TSC ticks per second, as calibrated, or 0 if the TSC is not used (yet)
+	static uint64_t tscFrequency() { return usingTSC() ? tscFrequency_ : 0; }
+
+private:
+	static constexpr unsigned tscShift = 32;
+
+	static int64_t fallbackNanosec() noexcept {
+#ifdef PERF_CLOCK_MONOTONIC_RAW
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+		return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+#ifdef PERF_CLOCK_TSC
+	// the slow path of nowNanosec() until the TSC is calibrated: returns fallbackNanosec() and advances the calibration
+	static int64_t calibrate() noexcept;
+#endif
+
+	// set once by calibrate() (see clock.cpp), tscMultiplier_ last with a release store; zero until then
+	static uint64_t tscBase_;
+	static int64_t nanosecBase_;	// fallbackNanosec() at the time the TSC read tscBase_
+	static std::atomic<uint64_t> tscMultiplier_;	// nanoseconds per tick, as a 32.32 fixed point number
+	static uint64_t tscFrequency_;
+};
+
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
@@ -15,55 +15,108 @@ namespace perf {
 
 std::atomic<FrameCapture::CaptureMode> FrameCapture::mode_ {FrameCapture::Disabled};
 std::atomic<std::thread::id> FrameCapture::exclusiveThreadID_;
-MTVector<std::shared_ptr<std::vector<FrameCapture::frameData>>> FrameCapture::allFrames_ {8};
+std::atomic<unsigned> FrameCapture::captureId_ {0};
+size_t FrameCapture::ringSize_ = 0;
+FrameCapture::OverflowPolicy FrameCapture::policy_ = FrameCapture::DropNewest;
+Clock::time_point FrameCapture::stopTime_;
+MTVector<std::shared_ptr<FrameCapture::threadRing>> FrameCapture::allRings_ {8};
 MTVector<std::string> FrameCapture::threadNames_ {8};
-std::chrono::time_point<std::chrono::high_resolution_clock> FrameCapture::captureStartTime_;
-#ifdef DEBUG_INSTANCES
-MTVector<FrameCapture*> FrameCapture::allInstances_ {8};
-#endif
 
-void FrameCapture::start(FrameCapture::CaptureMode mode) {
+void FrameCapture::start(FrameCapture::CaptureMode mode, size_t eventsPerThread, OverflowPolicy policy) {
 	assert(mode_.load(std::memory_order_acquire) == Disabled && "Capture already in progress!");
 	if (mode == ThisThreadOnly)
 		exclusiveThreadID_.store(std::this_thread::get_id(), std::memory_order_release);
-	captureStartTime_ = std::chrono::high_resolution_clock::now();
+	size_t size = 1;
+	while (size < eventsPerThread)
+		size <<= 1;
+	ringSize_ = size;
+	policy_ = policy;
+	// the rings reset themselves when they see a new capture id
+	captureId_.fetch_add(1, std::memory_order_relaxed);
 	mode_.store(mode, std::memory_order_release);
 }
 
 void FrameCapture::stop() {
 	mode_.store(Disabled, std::memory_order_release);
-	// check all unfinished frames
-	auto now = std::chrono::high_resolution_clock::now();
-	for (auto &tf : allFrames_)
-		for (auto &f : *tf)
-			if (f.endTime_.time_since_epoch().count() == 0)
-				f.endTime_ = now;
+	// frames that are still open at the time of getResults() end here
+	stopTime_ = Clock::now();
+}
+
+void FrameCapture::resetRing(threadRing &r, unsigned captureId) {
+	if (r.mask + 1 != ringSize_ || !r.events) {
+		r.events.reset(new event[ringSize_]);
+		r.mask = ringSize_ - 1;
+	}
+	r.policy = policy_;
+	r.depth = 0;
+	r.lost.store(0, std::memory_order_relaxed);
+	r.written.store(0, std::memory_order_relaxed);
+	// release: a thread that was already inside a marker when capturing stopped may be resetting its ring while
+	// getResults() runs, which only reads the rings whose id it sees matching
+	r.captureId.store(captureId, std::memory_order_release);
 }
 
 std::string FrameCapture::getThreadNameForIndex(unsigned index) {
-	assert(index < threadNames_.size());
-	return threadNames_[index];
+	// a thread that is just starting may have its ring published before its name
+	if (index >= threadNames_.publishedSize())
+		return "unknown thread";
+	return threadNames_.publishedAt(index);
 }
 
 std::vector<FrameCapture::frameData> FrameCapture::getResults() {
 	assert(mode_.load(std::memory_order_acquire) == Disabled && "Don't call this while capturing!!!");
+	unsigned captureId = captureId_.load(std::memory_order_relaxed);
 	std::vector<FrameCapture::frameData> ret;
-	for (auto &fv : allFrames_) {
-		assert (fv != nullptr);
-		// fv->getContentsExclusive(ret);
-		std::copy(fv->begin(), fv->end(), std::back_inserter(ret));
+	// a thread that marks its first frame now adds its ring, so only the published ones are read
+	for (size_t i=0, n=allRings_.publishedSize(); i<n; i++) {
+		auto &r = allRings_.publishedAt(i);
+		assert (r != nullptr);
+		// a ring that still belongs to an older capture recorded nothing in this one
+		if (r->captureId.load(std::memory_order_acquire) != captureId)
+			continue;
+		uint64_t written = r->written.load(std::memory_order_acquire);
+		size_t capacity = r->mask + 1;
+		uint64_t first = written > capacity ? written - capacity : 0;
+		size_t merged = ret.size();
+		for (uint64_t pos = first; pos < written; pos++) {
+			event &e = r->events[pos & r->mask];
+			int64_t start = e.startTime.load(std::memory_order_relaxed);
+			int64_t end = e.endTime.load(std::memory_order_relaxed);
+			uint32_t flags = e.flags.load(std::memory_order_relaxed);
+			ret.emplace_back(SectionNames::name(e.sectionId.load(std::memory_order_relaxed)).c_str(),
+				Clock::time_point(Clock::duration(start)), end ? Clock::time_point(Clock::duration(end)) : stopTime_,
+				r->threadIndex, flags & deadTimeFlag, flags & idleTimeFlag);
+		}
+		// a marker that was already inside beginFrame() when capturing stopped may have overwritten some of the oldest
+		// events while we were reading them; discard those
+		uint64_t writtenAfter = r->written.load(std::memory_order_acquire);
+		if (writtenAfter > capacity && writtenAfter - capacity > first) {
+			uint64_t torn = std::min(written, writtenAfter - capacity) - first;
+			ret.erase(ret.begin() + merged, ret.begin() + merged + torn);
+		}
 	}
+	// frames that start at the same time are nested, so put the longer (outer) ones first
 	std::sort(ret.begin(), ret.end(), [] (auto &x, auto &y) {
-		return x.startTime_ < y.startTime_;
+		return x.startTime_ < y.startTime_ || (x.startTime_ == y.startTime_ && x.endTime_ > y.endTime_);
 	});
 	return ret;
 }
 
+uint64_t FrameCapture::getLostEventsCount() {
+	unsigned captureId = captureId_.load(std::memory_order_relaxed);
+	uint64_t lost = 0;
+	for (size_t i=0, n=allRings_.publishedSize(); i<n; i++) {
+		auto &r = allRings_.publishedAt(i);
+		if (r->captureId.load(std::memory_order_acquire) == captureId)
+			lost += r->lost.load(std::memory_order_relaxed);
+	}
+	return lost;
+}
+
 void FrameCapture::cleanup() {
 	assert(mode_ == Disabled && "Don't call this while capturing!!!");
-	for (auto &fv : allFrames_) {
-		fv->clear();
-	}
+	// the rings are kept for the next capture, but a new capture id makes getResults() ignore their content
+	captureId_.fetch_add(1, std::memory_order_relaxed);
 }
 
 } /* namespace perf */
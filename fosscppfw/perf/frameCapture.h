@@ -11,6 +11,7 @@
 #ifdef ENABLE_PERF_PROFILING
 
 #include "callGraph.h"
+#include "clock.h"
 
 #include "../utils/MTVector.h"
 
@@ -24,6 +25,14 @@
 
 namespace perf {
 
+/*
+ * Records the start and end times of every marker (on one or all threads) between start() and stop().
+ *
+ * Each thread records into its own preallocated ring of compact events (section id, timestamps, flags), so recording
+ * never allocates, locks or copies names. When a ring fills up, either the newest events are dropped (DropNewest,
+ * keeps the beginning of the capture) or the oldest ones are overwritten (OverwriteOldest, keeps the end of it).
+ * getResults() merges the rings into a single chronological sequence.
+ */
 class FrameCapture {
 public:
 	enum CaptureMode {
@@ -32,30 +41,38 @@ public:
 		AllThreads,
 	};
 
+	enum OverflowPolicy {
+		DropNewest,
+		OverwriteOldest,
+	};
+
 	struct frameData {
-		std::chrono::time_point<std::chrono::high_resolution_clock> startTime_;
-		std::chrono::time_point<std::chrono::high_resolution_clock> endTime_;
-		char name_[256];
+		Clock::time_point startTime_;
+		Clock::time_point endTime_;
+		const char* name_;	// lives as long as the program (see SectionNames)
 		unsigned threadIndex_;
 		bool deadTime_;
 		bool idleTime_;
 
-		frameData(const char name[], std::chrono::time_point<std::chrono::high_resolution_clock> start,
+		frameData(const char name[], Clock::time_point start, Clock::time_point end,
 				unsigned threadIndex, bool deadTime, bool idleTime)
-			: startTime_(start), threadIndex_(threadIndex), deadTime_(deadTime), idleTime_(idleTime) {
-			strncpy(name_, name, sizeof(name_)/sizeof(name_[0]) - 1);
+			: startTime_(start), endTime_(end), name_(name), threadIndex_(threadIndex), deadTime_(deadTime), idleTime_(idleTime) {
 		}
 	};
 
-	// start capturing a frame, recording all markers' absolute times
-	static void start(CaptureMode mode);
+	// start capturing a frame, recording all markers' absolute times;
+	// eventsPerThread (rounded up to a power of two) is the size of each thread's ring
+	static void start(CaptureMode mode, size_t eventsPerThread = 1 << 16, OverflowPolicy policy = DropNewest);
 	// stop capturing the frame
 	static void stop();
 
 	// aggregates all calls from all recorded threads (depending on capture mode) and returns a linear sequence
-	// ordered chronologically, with interleaved threads
+	// ordered chronologically, with interleaved threads (frames that start at the same time: outer ones first)
 	static std::vector<frameData> getResults();
 
+	// the number of events that didn't fit into the rings during the last capture (dropped or overwritten)
+	static uint64_t getLostEventsCount();
+
 	// returns the name of the thread identified by index (use index from frameData)
 	static std::string getThreadNameForIndex(unsigned index);
 
@@ -65,6 +82,34 @@ public:
 private:
 	friend class Marker;
 
+	// all relaxed atomics: a marker that was already inside beginFrame() when capturing stopped may be overwriting an
+	// event while getResults() reads it (which then discards it)
+	struct event {
+		std::atomic<int64_t> startTime;	// Clock nanoseconds
+		std::atomic<int64_t> endTime;	// 0 while the frame is open
+		std::atomic<uint32_t> sectionId;
+		std::atomic<uint32_t> flags;
+	};
+	static_assert(sizeof(event) == 24, "keep events compact");
+
+	static constexpr uint32_t deadTimeFlag = 1;
+	static constexpr uint32_t idleTimeFlag = 2;
+	static constexpr unsigned maxDepth = 256;	// deeper frames are not recorded
+	static constexpr uint64_t noEvent = ~0ull;
+
+	// written only by the owning thread; read by getResults() once capturing has stopped
+	struct threadRing {
+		std::unique_ptr<event[]> events;
+		size_t mask = 0;
+		OverflowPolicy policy = DropNewest;
+		std::atomic<unsigned> captureId { 0 };	// the capture this ring's content belongs to; set last by resetRing()
+		unsigned threadIndex;
+		std::atomic<uint64_t> written { 0 };	// events ever written during the capture
+		std::atomic<uint64_t> lost { 0 };
+		unsigned depth = 0;
+		uint64_t openEvents[maxDepth];	// positions of the frames that haven't ended yet (or noEvent if they weren't recorded)
+	};
+
 	static bool captureEnabledOnThisThread() {
 		auto mode = mode_.load(std::memory_order_acquire);
 		if (mode == Disabled)
@@ -72,38 +117,70 @@ private:
 		return (mode == AllThreads || std::this_thread::get_id() == exclusiveThreadID_.load(std::memory_order_consume));
 	}
 
-	static void beginFrame(const char name[], std::chrono::time_point<std::chrono::high_resolution_clock> now, bool deadTime, bool idleTime) {
-		auto &ti = getThreadInstance();
-		ti.frames_->emplace_back(name, now, ti.threadIndex_, deadTime, idleTime);
-		ti.frameStack_.push(ti.frames_->size()-1);
+	static void beginFrame(unsigned sectionId, Clock::time_point now, bool deadTime, bool idleTime) {
+		threadRing &r = getThreadRing();
+		if (r.depth >= maxDepth) {
+			r.depth++;
+			r.lost.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		uint64_t pos = r.written.load(std::memory_order_relaxed);
+		if (pos > r.mask && r.policy == DropNewest) {
+			r.openEvents[r.depth++] = noEvent;
+			r.lost.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		if (pos > r.mask)
+			r.lost.fetch_add(1, std::memory_order_relaxed);	// overwriting the oldest one
+		event &e = r.events[pos & r.mask];
+		e.startTime.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+		e.endTime.store(0, std::memory_order_relaxed);
+		e.sectionId.store(sectionId, std::memory_order_relaxed);
+		e.flags.store((deadTime ? deadTimeFlag : 0) | (idleTime ? idleTimeFlag : 0), std::memory_order_relaxed);
+		r.written.store(pos + 1, std::memory_order_release);
+		r.openEvents[r.depth++] = pos;
 	}
 
-	static void endFrame(std::chrono::time_point<std::chrono::high_resolution_clock> now) {
-		if (!getThreadInstance().frameStack_.size()) {
-			beginFrame("{UNKNOWN}", captureStartTime_, true, false);
-		}
-		auto &ti = getThreadInstance();
-		(*ti.frames_)[ti.frameStack_.top()].endTime_ = now;
-		ti.frameStack_.pop();
+	static void endFrame(Clock::time_point now) {
+		threadRing &r = getThreadRing();
+		if (r.depth == 0)
+			return;	// the frame began in a previous capture
+		if (r.depth-- > maxDepth)
+			return;
+		uint64_t pos = r.openEvents[r.depth];
+		if (pos == noEvent || r.written.load(std::memory_order_relaxed) - pos > r.mask + 1)
+			return;	// dropped, or overwritten since it began
+		r.events[pos & r.mask].endTime.store(now.time_since_epoch().count(), std::memory_order_relaxed);
 	}
 
 	static std::atomic<CaptureMode> mode_;
 	static std::atomic<std::thread::id> exclusiveThreadID_;
-	static MTVector<std::shared_ptr<std::vector<frameData>>> allFrames_;
+	static std::atomic<unsigned> captureId_;
+	static size_t ringSize_;
+	static OverflowPolicy policy_;
+	static Clock::time_point stopTime_;
+	static MTVector<std::shared_ptr<threadRing>> allRings_;
 	static MTVector<std::string> threadNames_;
-	static std::chrono::time_point<std::chrono::high_resolution_clock> captureStartTime_;
 
-	std::shared_ptr<std::vector<frameData>> frames_;
-	std::stack<int> frameStack_;
-	unsigned threadIndex_;
+	std::shared_ptr<threadRing> ring_;
+
+	// returns this thread's ring, reset for the current capture
+	static threadRing& getThreadRing() {
+		threadRing &r = *getThreadInstance().ring_;
+		unsigned id = captureId_.load(std::memory_order_relaxed);
+		if (r.captureId.load(std::memory_order_relaxed) != id)
+			resetRing(r, id);
+		return r;
+	}
+	static void resetRing(threadRing &r, unsigned captureId);
+
 	static FrameCapture& getThreadInstance() {
 		static thread_local FrameCapture instance;
 		return instance;
 	}
-	FrameCapture() : frames_(new std::vector<frameData>()) {
-		frames_->reserve(1024);
-		allFrames_.push_back(frames_);
-		threadIndex_ = threadNames_.push_back(CallGraph::getCrtThreadName());
+	FrameCapture() : ring_(new threadRing()) {
+		ring_->threadIndex = threadNames_.push_back(CallGraph::getCrtThreadName());
+		allRings_.push_back(ring_);
 	}
 };
 
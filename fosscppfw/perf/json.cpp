@@ -13,6 +13,12 @@ nlohmann::json callFrame(perf::sectionData const& s) {
 	frame["inclusive"] = { {"nanoseconds", s.getInclusiveNanosec()} };
 	frame["exclusive"] = { {"nanoseconds", s.getExclusiveNanosec()} };
 	frame["blocked"] = s.isDeadTime();
+	if (auto h = s.getHistogram()) {
+		frame["p50"] = { {"nanoseconds", h->percentile(50)} };
+		frame["p90"] = { {"nanoseconds", h->percentile(90)} };
+		frame["p99"] = { {"nanoseconds", h->percentile(99)} };
+		frame["max"] = { {"nanoseconds", h->max()} };
+	}
 	return frame;
 }
 
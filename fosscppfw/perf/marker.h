@@ -9,9 +9,11 @@
 #define PERF_MARKER_H_
 
 #include "callGraph.h"
+#include "clock.h"
 #include "frameCapture.h"
+#include "sampler.h"
+#include "sectionNames.h"
 
-#include <chrono>
 #include <string>
 
 #ifdef ENABLE_PERF_PROFILING
@@ -27,11 +29,16 @@
 #ifdef ENABLE_PERF_MARKERS
 	#define COMBINE1(X,Y) X##Y  // helper macro
 	#define COMBINE(X,Y) COMBINE1(X,Y)
-	#define PERF_MARKER_FUNC perf::Marker COMBINE(funcMarker,__LINE__)(__PRETTY_FUNCTION__)
-	#define PERF_MARKER_FUNC_BLOCKED perf::Marker COMBINE(funcMarker,__LINE__)(__PRETTY_FUNCTION__, true)
-	#define PERF_MARKER(NAME) perf::Marker COMBINE(perfMarker, __LINE__)(NAME)
-	#define PERF_MARKER_BLOCKED(NAME) perf::Marker COMBINE(perfMarker,__LINE__)(NAME, true)
-	#define PERF_MARKER_IDLE(NAME) perf::Marker COMBINE(perfMarker,__LINE__)(NAME, false, true)
+	// each marker site interns its name once, in a function-local static, and then only passes the id around,
+	// so NAME must be the same every time a site runs; construct a perf::Marker directly for names built at run time
+	#define PERF_MARKER_SITE(NAME, ...) \
+		static const unsigned COMBINE(perfMarkerId,__LINE__) = perf::SectionNames::intern(NAME); \
+		perf::Marker COMBINE(perfMarker,__LINE__)(COMBINE(perfMarkerId,__LINE__), ##__VA_ARGS__)
+	#define PERF_MARKER_FUNC PERF_MARKER_SITE(__PRETTY_FUNCTION__)
+	#define PERF_MARKER_FUNC_BLOCKED PERF_MARKER_SITE(__PRETTY_FUNCTION__, true)
+	#define PERF_MARKER(NAME) PERF_MARKER_SITE(NAME)
+	#define PERF_MARKER_BLOCKED(NAME) PERF_MARKER_SITE(NAME, true)
+	#define PERF_MARKER_IDLE(NAME) PERF_MARKER_SITE(NAME, false, true)
 #else
 	#define PERF_MARKER_FUNC
 	#define PERF_MARKER_FUNC_BLOCKED
@@ -44,32 +51,51 @@ namespace perf {
 
 inline void setCrtThreadName(std::string name) {
 #ifdef ENABLE_PERF_PROFILING
-	CallGraph::getCrtThreadInstance().threadName_ = name;
+	auto &graph = CallGraph::getCrtThreadInstance();
+	std::lock_guard<std::mutex> lk(graph.nameMutex_);
+	graph.threadName_ = std::move(name);
 #endif
 }
 
 #ifdef ENABLE_PERF_PROFILING
 class Marker {
 public:
-	Marker(const char name[], bool blocked = false, bool idle = false) {
-		CallGraph::pushSection(name, blocked);
-		start_ = std::chrono::high_resolution_clock::now();
-		if (FrameCapture::captureEnabledOnThisThread()) {
-			FrameCapture::beginFrame(name, start_, blocked, idle);
+	// sectionId comes from SectionNames::intern()
+	explicit Marker(unsigned sectionId, bool blocked = false, bool idle = false) {
+		Sampler::enterSection(sectionId);
+		recording_ = CallGraph::recordingEnabled();
+		capturing_ = FrameCapture::captureEnabledOnThisThread();
+		if (recording_)
+			CallGraph::pushSection(sectionId, blocked);
+		if (recording_ || capturing_)
+			start_ = Clock::now();
+		if (capturing_) {
+			FrameCapture::beginFrame(sectionId, start_, blocked, idle);
 		}
 	}
 
+	// for names that aren't known at compile time; interns the name on every call
+	explicit Marker(const char name[], bool blocked = false, bool idle = false)
+		: Marker(SectionNames::intern(name), blocked, idle) {
+	}
+
 	~Marker() {
-		auto end = std::chrono::high_resolution_clock::now();
-		auto nanosec = std::chrono::nanoseconds(end - start_).count();
-		CallGraph::popSection(nanosec);
-		if (FrameCapture::captureEnabledOnThisThread()) {
-			FrameCapture::endFrame(end);
+		if (recording_ || capturing_) {
+			auto end = Clock::now();
+			if (recording_)
+				CallGraph::popSection((end - start_).count());
+			if (capturing_) {
+				FrameCapture::endFrame(end);
+			}
 		}
+		Sampler::leaveSection();
 	}
 
 private:
-	std::chrono::time_point<std::chrono::high_resolution_clock> start_;
+	Clock::time_point start_;
+	// checked once, so that a section is either recorded whole or not at all
+	bool recording_;
+	bool capturing_;
 };
 
 #endif // ENABLE_PERF_PROFILING
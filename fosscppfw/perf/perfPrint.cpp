@@ -16,6 +16,7 @@
 #include <iostream>
 #include <algorithm>
 #include <map>
+#include <numeric>
 #include <memory>
 #include <stdint.h>
 
@@ -78,6 +79,12 @@ void printCallFrame(perf::sectionData const& s, bool flatMode/*=false*/, std::os
 		if (!flatMode)
 			os << "avg-exc " << formatTime(s.getExclusiveNanosec() / s.getExecutionCount());
 	}
+	if (auto h = s.getHistogram()) {
+		os << (flatMode ? "" : " | ")
+			<< "p50 " << formatTime(h->percentile(50)) << " | "
+			<< "p99 " << formatTime(h->percentile(99)) << " | "
+			<< "max " << formatTime(h->max()) << " ";
+	}
 	os << "}" << ioModif::RESET;
 }
 
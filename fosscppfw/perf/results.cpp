@@ -17,42 +17,119 @@ namespace perf {
 MTVector<std::shared_ptr<CallGraph>> Results::threadGraphs_ { 64 };
 
 std::string Results::getThreadName(unsigned id) {
-	if (id > threadGraphs_.size())
+	if (id >= threadGraphs_.publishedSize())
 		return "unknown thread";
-	return threadGraphs_[id]->threadName_;
+	return threadGraphs_.publishedAt(id)->getThreadName();
 }
 
 // get a list of independent call trees on the specified thread
 std::vector<std::shared_ptr<sectionData>> Results::getCallTrees(unsigned threadID) {
-	if (threadID >= threadGraphs_.size())
+	if (threadID >= threadGraphs_.publishedSize())
 		return {};
-	return threadGraphs_[threadID]->rootTrees_;
+	auto &graph = *threadGraphs_.publishedAt(threadID);
+	return graph.exportTrees(graph.firstRoot_.load(std::memory_order_acquire));
 }
 
 std::vector<std::shared_ptr<sectionData>> Results::getCallTrees(std::string const& threadName) {
-	for (unsigned i=0; i<threadGraphs_.size(); i++)
-		if (threadGraphs_[i]->threadName_ == threadName)
+	for (unsigned i=0; i<threadGraphs_.publishedSize(); i++)
+		if (threadGraphs_.publishedAt(i)->getThreadName() == threadName)
 			return getCallTrees(i);
 	return {};
 }
 
 // get a flat list of frames on the specified thread
 std::vector<sectionData> Results::getFlatList(unsigned threadID) {
-	if (threadID >= threadGraphs_.size())
+	if (threadID >= threadGraphs_.publishedSize())
 		return {};
-	std::vector<sectionData> ret;
-	for (auto &p : threadGraphs_[threadID]->flatSectionData_)
-		ret.push_back(*p.second);
-	return ret;
+	return threadGraphs_.publishedAt(threadID)->exportFlatList();
 }
 
 std::vector<sectionData> Results::getFlatList(std::string const& threadName) {
-	for (unsigned i=0; i<threadGraphs_.size(); i++)
-		if (threadGraphs_[i]->threadName_ == threadName)
+	for (unsigned i=0; i<threadGraphs_.publishedSize(); i++)
+		if (threadGraphs_.publishedAt(i)->getThreadName() == threadName)
 			return getFlatList(i);
 	return {};
 }
 
+void Results::mergeTrees(std::vector<std::shared_ptr<sectionData>> &dest, std::vector<std::shared_ptr<sectionData>> const& src) {
+	for (auto &s : src) {
+		auto it = std::find_if(dest.begin(), dest.end(), [&s](auto const& d) { return d->id_ == s->id_; });
+		if (it == dest.end()) {
+			dest.push_back(s);	// the exported trees are private copies, so they can be taken over as they are
+			continue;
+		}
+		auto &d = **it;
+		d.nanoseconds_ += s->nanoseconds_;
+		d.calleeNanoseconds_ += s->calleeNanoseconds_;
+		d.executionCount_ += s->executionCount_;
+		d.deadTime_ = d.deadTime_ || s->deadTime_;
+		mergeTrees(d.callees_, s->callees_);
+	}
+}
+
+void Results::mergeFlatLists(std::vector<sectionData> &dest, std::vector<sectionData> const& src) {
+	for (auto &s : src) {
+		auto it = std::find_if(dest.begin(), dest.end(), [&s](auto const& d) { return d.id_ == s.id_; });
+		if (it == dest.end()) {
+			dest.push_back(s);
+			continue;
+		}
+		it->nanoseconds_ += s.nanoseconds_;
+		it->executionCount_ += s.executionCount_;
+		if (it->histogram_ && s.histogram_)
+			it->histogram_->merge(*s.histogram_);
+	}
+}
+
+template<class PRED>
+std::vector<std::shared_ptr<sectionData>> Results::mergeCallTrees(PRED pred) {
+	std::vector<std::shared_ptr<sectionData>> ret;
+	for (unsigned i=0; i<threadGraphs_.publishedSize(); i++)
+		if (pred(threadGraphs_.publishedAt(i)->getThreadName()))
+			mergeTrees(ret, getCallTrees(i));
+	return ret;
+}
+
+template<class PRED>
+std::vector<sectionData> Results::mergeFlatLists(PRED pred) {
+	std::vector<sectionData> ret;
+	for (unsigned i=0; i<threadGraphs_.publishedSize(); i++)
+		if (pred(threadGraphs_.publishedAt(i)->getThreadName()))
+			mergeFlatLists(ret, getFlatList(i));
+	return ret;
+}
+
+std::vector<std::shared_ptr<sectionData>> Results::getMergedCallTrees() {
+	return mergeCallTrees([](std::string const&) { return true; });
+}
+
+std::vector<std::shared_ptr<sectionData>> Results::getMergedCallTrees(std::string const& threadName) {
+	return mergeCallTrees([&threadName](std::string const& name) { return name == threadName; });
+}
+
+std::vector<sectionData> Results::getMergedFlatList() {
+	return mergeFlatLists([](std::string const&) { return true; });
+}
+
+std::vector<sectionData> Results::getMergedFlatList(std::string const& threadName) {
+	return mergeFlatLists([&threadName](std::string const& name) { return name == threadName; });
+}
+
+LatencyHistogram Results::getHistogram(std::string const& sectionName) {
+	unsigned id = SectionNames::intern(sectionName.c_str());
+	LatencyHistogram ret;
+	for (unsigned i=0; i<threadGraphs_.publishedSize(); i++) {
+		auto &graph = *threadGraphs_.publishedAt(i);
+		if (id >= graph.flatSize_.load(std::memory_order_acquire))
+			continue;
+		auto p = graph.flatSectionData_.tryGet(id);
+		CallGraph::flatTotals* flat = p ? p->load(std::memory_order_acquire) : nullptr;
+		if (flat)
+			ret.merge(flat->histogram);
+	}
+	return ret;
+}
+
 } // namespace perf
 
 #endif // ENABLE_PERF_PROFILING
@@ -10,8 +10,11 @@
 
 #ifdef ENABLE_PERF_PROFILING
 
+#include "histogram.h"
+
 #include "../utils/MTVector.h"
 #include <memory>
+#include <string>
 #include <vector>
 
 namespace perf {
@@ -23,8 +26,15 @@ class Results {
 	friend class CallGraph;
 public:
 
+	/*
+	 * All the getters below may be called from any thread while the profiled threads keep running (for example to
+	 * scrape the results periodically from a monitoring thread). They return copies; the counters of each call-tree
+	 * node and each flat list entry are read together, from the same moment (see CallGraph::readConsistent()),
+	 * while different nodes may be read a few calls apart.
+	 */
+
 	// return the number of threads that contain traced calls
-	static unsigned getNumberOfThreads() { return threadGraphs_.size(); }
+	static unsigned getNumberOfThreads() { return threadGraphs_.publishedSize(); }
 
 	static std::string getThreadName(unsigned id);
 
@@ -37,12 +47,33 @@ public:
 	// get a flat list of frames on the specified named thread
 	static std::vector<sectionData> getFlatList(std::string const& threadName);
 
+	// get the call trees of all the threads merged together: calls along the same path of sections add up
+	static std::vector<std::shared_ptr<sectionData>> getMergedCallTrees();
+	// get the merged call trees of all the threads with the specified name (such as the workers of a thread pool)
+	static std::vector<std::shared_ptr<sectionData>> getMergedCallTrees(std::string const& threadName);
+	// get the flat lists of all the threads merged together
+	static std::vector<sectionData> getMergedFlatList();
+	// get the merged flat lists of all the threads with the specified name
+	static std::vector<sectionData> getMergedFlatList(std::string const& threadName);
+
+	// get the distribution of the durations of a section, merged over all the threads
+	static LatencyHistogram getHistogram(std::string const& sectionName);
+
 private:
 	static MTVector<std::shared_ptr<CallGraph>> threadGraphs_;
 
 	static void registerGraph(std::shared_ptr<CallGraph> graph) {
 		threadGraphs_.push_back(graph);
 	}
+
+	// adds up src into dest; sections are matched by id, and unmatched ones are appended
+	static void mergeTrees(std::vector<std::shared_ptr<sectionData>> &dest, std::vector<std::shared_ptr<sectionData>> const& src);
+	static void mergeFlatLists(std::vector<sectionData> &dest, std::vector<sectionData> const& src);
+	// merges the threads for which pred(threadName) is true
+	template<class PRED>
+	static std::vector<std::shared_ptr<sectionData>> mergeCallTrees(PRED pred);
+	template<class PRED>
+	static std::vector<sectionData> mergeFlatLists(PRED pred);
 };
 
 }
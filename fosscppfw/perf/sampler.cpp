@@ -0,0 +1,159 @@
+/*
+ * sampler.cpp
+ */
+#ifdef ENABLE_PERF_PROFILING
+
+#include "./sampler.h"
+#include "./sectionNames.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace perf {
+
+thread_local Sampler::threadStack* Sampler::crtStack_ = nullptr;
+MTVector<std::shared_ptr<Sampler::threadStack>> Sampler::allStacks_ { 64 };
+
+namespace {
+	std::mutex mutex_;	// guards everything below
+	std::condition_variable stopCondition_;
+	std::thread samplerThread_;
+	bool stopRequested_ = false;
+	size_t maxStacks_ = 0;
+	std::unordered_map<std::string, uint64_t> counts_;	// key: the raw bytes of the stack's section ids
+	uint64_t overflowCount_ = 0;
+
+	std::string keyOf(unsigned const* ids, unsigned depth) {
+		return std::string(reinterpret_cast<const char*>(ids), depth * sizeof(unsigned));
+	}
+}
+
+void Sampler::registerThread() {
+	// take over the stack of a thread that has exited, if there is one
+	// (other threads may be registering meanwhile: publishedAt() is safe below publishedSize(), see MTVector.h)
+	for (size_t i=0; i<allStacks_.publishedSize() && !crtStack_; i++) {
+		bool dead = false;
+		if (allStacks_.publishedAt(i)->alive.compare_exchange_strong(dead, true, std::memory_order_relaxed))
+			crtStack_ = allStacks_.publishedAt(i).get();
+	}
+	if (!crtStack_) {
+		auto stack = std::make_shared<threadStack>();
+		crtStack_ = stack.get();
+		allStacks_.push_back(stack);
+	}
+	// marks the stack dead when the thread exits, so that the sampler skips it
+	static thread_local struct deathNotifier {
+		threadStack* pStack;
+		~deathNotifier() { pStack->alive.store(false, std::memory_order_relaxed); }
+	} notifier { crtStack_ };
+}
+
+void Sampler::start(unsigned frequencyHz, size_t maxStacks) {
+	std::lock_guard<std::mutex> lk(mutex_);
+	if (samplerThread_.joinable())
+		return;
+	stopRequested_ = false;
+	maxStacks_ = maxStacks;
+	auto period = std::chrono::nanoseconds(1000000000 / std::max(1u, frequencyHz));
+	samplerThread_ = std::thread([period] {
+		unsigned ids[maxDepth];
+		std::unique_lock<std::mutex> lk(mutex_);
+		auto next = std::chrono::steady_clock::now();
+		while (true) {
+			next += period;
+			if (stopCondition_.wait_until(lk, next, [] { return stopRequested_; }))
+				return;
+			// threads keep registering while we sample; the published prefix is safe to read (see MTVector::publishedAt())
+			for (size_t i=0; i<allStacks_.publishedSize(); i++) {
+				auto &s = *allStacks_.publishedAt(i);
+				if (!s.alive.load(std::memory_order_relaxed))
+					continue;
+				// copy the stack, retrying a few times if the thread is changing it; skip the thread if it keeps doing so
+				unsigned depth = 0;
+				bool consistent = false;
+				for (int attempt=0; attempt<4 && !consistent; attempt++) {
+					unsigned seq = s.seq.load(std::memory_order_acquire);
+					if (seq & 1)
+						continue;
+					depth = std::min(maxDepth, s.depth.load(std::memory_order_relaxed));
+					for (unsigned k=0; k<depth; k++)
+						ids[k] = s.ids[k].load(std::memory_order_relaxed);
+					std::atomic_thread_fence(std::memory_order_acquire);
+					consistent = s.seq.load(std::memory_order_relaxed) == seq;
+				}
+				if (!consistent || depth == 0)
+					continue;	// not inside any marker
+				auto key = keyOf(ids, depth);
+				auto it = counts_.find(key);
+				if (it != counts_.end())
+					it->second++;
+				else if (counts_.size() < maxStacks_)
+					counts_.emplace(std::move(key), 1);
+				else
+					overflowCount_++;
+			}
+		}
+	});
+}
+
+void Sampler::stop() {
+	std::thread t;
+	{
+		std::lock_guard<std::mutex> lk(mutex_);
+		stopRequested_ = true;
+		t = std::move(samplerThread_);
+	}
+	stopCondition_.notify_all();
+	if (t.joinable())
+		t.join();
+}
+
+bool Sampler::isRunning() {
+	std::lock_guard<std::mutex> lk(mutex_);
+	return samplerThread_.joinable();
+}
+
+std::vector<Sampler::sampledStack> Sampler::getResults() {
+	std::lock_guard<std::mutex> lk(mutex_);
+	std::vector<sampledStack> ret;
+	ret.reserve(counts_.size());
+	for (auto &p : counts_) {
+		auto ids = reinterpret_cast<unsigned const*>(p.first.data());
+		ret.push_back({ std::vector<unsigned>(ids, ids + p.first.size() / sizeof(unsigned)), p.second });
+	}
+	return ret;
+}
+
+uint64_t Sampler::getOverflowCount() {
+	std::lock_guard<std::mutex> lk(mutex_);
+	return overflowCount_;
+}
+
+void Sampler::writeCollapsedStacks(std::ostream &os) {
+	for (auto &s : getResults()) {
+		for (size_t i=0; i<s.sectionIds.size(); i++) {
+			if (i)
+				os << ';';
+			// ';' separates the frames, so it can't appear in a name
+			std::string name = SectionNames::name(s.sectionIds[i]);
+			std::replace(name.begin(), name.end(), ';', ',');
+			os << name;
+		}
+		os << ' ' << s.count << '\n';
+	}
+}
+
+void Sampler::reset() {
+	std::lock_guard<std::mutex> lk(mutex_);
+	counts_.clear();
+	overflowCount_ = 0;
+}
+
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
@@ -0,0 +1,99 @@
+/*
+ * sampler.h
+ *
+ *  Statistical profiling that can stay on in production.
+ *
+ *  Every marker publishes the section ids of its thread's current marker stack (a couple of relaxed stores, with
+ *  no clock reads). While sampling is on, a sampler thread wakes up at a fixed frequency, copies the published stack
+ *  of every live thread (retrying if the thread changed it meanwhile), and counts how often each distinct stack was
+ *  seen, in a table bounded to a fixed number of stacks. The counts are flame graph data: the time spent in a stack
+ *  is about its count divided by the frequency.
+ *
+ *  To profile with sampling only, turn off the call graph (CallGraph::setRecordingEnabled(false)) - markers then
+ *  cost a few nanoseconds and nothing accumulates per call.
+ */
+#pragma once
+
+#ifdef ENABLE_PERF_PROFILING
+
+#include "../utils/MTVector.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <vector>
+
+namespace perf {
+
+class Sampler {
+public:
+	struct sampledStack {
+		std::vector<unsigned> sectionIds;	// outermost first (see SectionNames)
+		uint64_t count;
+	};
+
+	// starts the sampler thread; maxStacks bounds the number of distinct stacks that are counted separately
+	static void start(unsigned frequencyHz = 99, size_t maxStacks = 4096);
+	// stops the sampler thread; the counts are kept until reset()
+	static void stop();
+	static bool isRunning();
+
+	// the counted stacks, in no particular order
+	static std::vector<sampledStack> getResults();
+	// samples of stacks that arrived after maxStacks distinct ones were already counted
+	static uint64_t getOverflowCount();
+	// writes the results in the "collapsed stacks" format (one "outer;inner;leaf count" line per stack),
+	// which flamegraph.pl, speedscope and most other flame graph tools read
+	static void writeCollapsedStacks(std::ostream &os);
+	static void reset();
+
+private:
+	friend class Marker;
+
+	static constexpr unsigned maxDepth = 64;	// deeper sections are counted in their ancestor at this depth
+
+	// written by the owning thread only, as a seqlock: seq is odd while the stack is being changed
+	// (a thread that reuses the stack of an exited one finds depth back at 0, since every marker has been left)
+	struct threadStack {
+		std::atomic<unsigned> seq { 0 };
+		std::atomic<unsigned> depth { 0 };
+		std::atomic<unsigned> ids[maxDepth];
+		std::atomic<bool> alive { true };
+	};
+
+	static void enterSection(unsigned sectionId) {
+		threadStack &s = crtStack();
+		unsigned seq = s.seq.load(std::memory_order_relaxed);
+		unsigned depth = s.depth.load(std::memory_order_relaxed);
+		s.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		if (depth < maxDepth)
+			s.ids[depth].store(sectionId, std::memory_order_relaxed);
+		s.depth.store(depth + 1, std::memory_order_relaxed);
+		s.seq.store(seq + 2, std::memory_order_release);
+	}
+
+	static void leaveSection() {
+		threadStack &s = crtStack();
+		unsigned seq = s.seq.load(std::memory_order_relaxed);
+		s.seq.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		s.depth.store(s.depth.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+		s.seq.store(seq + 2, std::memory_order_release);
+	}
+
+	static threadStack& crtStack() {
+		if (!crtStack_)
+			registerThread();
+		return *crtStack_;
+	}
+	static void registerThread();
+
+	static thread_local threadStack* crtStack_;
+	static MTVector<std::shared_ptr<threadStack>> allStacks_;	// never shrinks, the stacks of exited threads are reused
+};
+
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
@@ -8,52 +8,48 @@
 
 #ifdef ENABLE_PERF_PROFILING
 
+#include "histogram.h"
+#include "sectionNames.h"
+
 #include <string>
 #include <vector>
 #include <memory>
-#include <numeric>
-
-#include <cstring>
+#include <cstdint>
 
 namespace perf {
 
+// a section's timings, as returned by Results (a copy taken from the live call graph)
 class sectionData {
 public:
-	std::basic_string<char> getName() const { return name_; }
+	std::basic_string<char> getName() const { return SectionNames::name(id_); }
+	unsigned getId() const { return id_; }
 	bool isDeadTime() const { return deadTime_; }
 	uint64_t getInclusiveNanosec() const { return nanoseconds_; }
 	uint64_t getExclusiveNanosec() const {
-		uint64_t acc = std::accumulate(callees_.begin(), callees_.end(), (uint64_t)0,
-			[] (auto sum, auto &callee) {
-			return sum + callee->nanoseconds_;
-		});
-		if (acc > nanoseconds_) {
+		if (calleeNanoseconds_ > nanoseconds_) {
 			return 0;
 		}
-		return nanoseconds_ - acc;
+		return nanoseconds_ - calleeNanoseconds_;
 	}
 	unsigned getExecutionCount() const { return executionCount_; }
 	const std::vector<std::shared_ptr<sectionData>>& getCallees() const { return callees_; }
 
+	// distribution of the inclusive time of the individual calls; only available in flat lists (nullptr in call trees)
+	std::shared_ptr<const LatencyHistogram> getHistogram() const { return histogram_; }
+
 private:
 	friend class CallGraph;
+	friend class Results;
 
-	static std::shared_ptr<sectionData> make_shared(const char name[]) {
-		return std::shared_ptr<sectionData>(new sectionData(name));
-	}
-	static std::unique_ptr<sectionData> make_unique(const char name[]) {
-		return std::unique_ptr<sectionData>(new sectionData(name));
-	}
-
-	explicit sectionData(const char name[]) {
-		strncpy(name_, name, sizeof(name_)/sizeof(name_[0]) - 1);
-	}
+	explicit sectionData(unsigned id) : id_(id) {}
 
+	unsigned id_;	// see SectionNames
 	uint64_t nanoseconds_ = 0;
+	uint64_t calleeNanoseconds_ = 0;	// the callees' inclusive time
 	uint64_t executionCount_ = 0;
-	char name_[256];
 	bool deadTime_ = false;
 	std::vector<std::shared_ptr<sectionData>> callees_;
+	std::shared_ptr<LatencyHistogram> histogram_;
 };
 
 }
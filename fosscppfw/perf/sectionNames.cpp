@@ -0,0 +1,27 @@
+/*
+ * sectionNames.cpp
+ */
+#ifdef ENABLE_PERF_PROFILING
+
+#include "./sectionNames.h"
+
+namespace perf {
+
+MTVector<std::string> SectionNames::names_ { 256 };
+std::unordered_map<std::string, unsigned> SectionNames::ids_;
+std::mutex SectionNames::mutex_;
+
+unsigned SectionNames::intern(const char name[]) {
+	std::lock_guard<std::mutex> lk(mutex_);
+	auto it = ids_.find(name);
+	if (it != ids_.end())
+		return it->second;
+	// names_ is only appended to under the mutex, so its index is the next id
+	unsigned id = names_.push_back(name);
+	ids_.emplace(name, id);
+	return id;
+}
+
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
@@ -0,0 +1,38 @@
+/*
+ * sectionNames.h
+ *
+ *  Interning of perf section names: each distinct name gets a small integer id, once, so that the markers and the
+ *  call graph deal with ids instead of comparing and hashing strings.
+ */
+#pragma once
+
+#ifdef ENABLE_PERF_PROFILING
+
+#include "../utils/MTVector.h"
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace perf {
+
+class SectionNames {
+public:
+	// returns the id for name, assigning a new one the first time a name is seen; identical names get the same id
+	static unsigned intern(const char name[]);
+
+	// returns the name for an id returned by intern(); lock-free, the returned string lives forever
+	static std::string const& name(unsigned id) { return names_[id]; }
+
+	// the number of ids handed out so far; all ids are below this
+	static unsigned count() { return names_.size(); }
+
+private:
+	static MTVector<std::string> names_;	// indexed by id
+	static std::unordered_map<std::string, unsigned> ids_;	// guarded by mutex_
+	static std::mutex mutex_;
+};
+
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
@@ -0,0 +1,212 @@
+/*
+ * traceExport.cpp
+ */
+#ifdef ENABLE_PERF_PROFILING
+
+#include "./traceExport.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace perf {
+namespace trace {
+
+namespace {
+
+const int64_t pid = 1;	// all threads are shown as part of a single process
+
+std::string threadName(unsigned threadIndex) {
+	std::string name = FrameCapture::getThreadNameForIndex(threadIndex);
+	return name.empty() ? "thread " + std::to_string(threadIndex) : name;
+}
+
+void writeJsonString(std::ostream &os, const char* s) {
+	static const char hex[] = "0123456789abcdef";
+	os << '"';
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\')
+			os << '\\' << c;
+		else if (c < 0x20)
+			os << "\\u00" << hex[c >> 4] << hex[c & 15];
+		else
+			os << c;
+	}
+	os << '"';
+}
+
+// trace event timestamps are microseconds; keep the nanoseconds as decimals
+void writeMicroseconds(std::ostream &os, int64_t nanosec) {
+	if (nanosec < 0) {
+		os << '-';
+		nanosec = -nanosec;
+	}
+	char frac[4] = { char('0' + nanosec / 100 % 10), char('0' + nanosec / 10 % 10), char('0' + nanosec % 10), 0 };
+	os << nanosec / 1000 << '.' << frac;
+}
+
+// --- minimal protobuf wire format encoding ---
+
+void putVarint(std::string &buf, uint64_t v) {
+	while (v >= 0x80) {
+		buf.push_back(char(v | 0x80));
+		v >>= 7;
+	}
+	buf.push_back(char(v));
+}
+
+void putVarintField(std::string &buf, unsigned field, uint64_t v) {
+	putVarint(buf, field << 3 | 0);
+	putVarint(buf, v);
+}
+
+void putBytesField(std::string &buf, unsigned field, const char* data, size_t size) {
+	putVarint(buf, field << 3 | 2);
+	putVarint(buf, size);
+	buf.append(data, size);
+}
+
+void putBytesField(std::string &buf, unsigned field, std::string const& data) {
+	putBytesField(buf, field, data.data(), data.size());
+}
+
+// field numbers from perfetto/protos/perfetto/trace/...
+namespace pb {
+	const unsigned tracePacket = 1;	// Trace.packet
+	const unsigned packetTimestamp = 8;
+	const unsigned packetSequenceId = 10;	// trusted_packet_sequence_id
+	const unsigned packetTrackEvent = 11;
+	const unsigned packetTrackDescriptor = 60;
+	const unsigned trackUuid = 1;	// TrackDescriptor.uuid
+	const unsigned trackName = 2;
+	const unsigned trackThread = 4;
+	const unsigned threadPid = 1;	// ThreadDescriptor.pid
+	const unsigned threadTid = 2;
+	const unsigned threadName = 5;
+	const unsigned eventType = 9;	// TrackEvent.type
+	const unsigned eventTrackUuid = 11;
+	const unsigned eventCategories = 22;
+	const unsigned eventName = 23;
+	const uint64_t sliceBegin = 1;
+	const uint64_t sliceEnd = 2;
+}
+
+class perfettoWriter {
+public:
+	explicit perfettoWriter(std::ostream &os) : os_(os) {}
+
+	void threadTrack(unsigned threadIndex) {
+		std::string thread;
+		putVarintField(thread, pb::threadPid, pid);
+		putVarintField(thread, pb::threadTid, threadIndex + 1);
+		putBytesField(thread, pb::threadName, threadName(threadIndex));
+		std::string track;
+		putVarintField(track, pb::trackUuid, trackUuid(threadIndex));
+		putBytesField(track, pb::trackThread, thread);
+		packet_.clear();
+		putBytesField(packet_, pb::packetTrackDescriptor, track);
+		putVarintField(packet_, pb::packetSequenceId, sequenceId(threadIndex));
+		flushPacket();
+	}
+
+	void slice(uint64_t type, int64_t timestamp, unsigned threadIndex, FrameCapture::frameData const* f) {
+		event_.clear();
+		putVarintField(event_, pb::eventType, type);
+		putVarintField(event_, pb::eventTrackUuid, trackUuid(threadIndex));
+		if (f) {
+			if (f->deadTime_ || f->idleTime_)
+				putBytesField(event_, pb::eventCategories, f->idleTime_ ? "idle" : "blocked");
+			putBytesField(event_, pb::eventName, f->name_, strlen(f->name_));
+		}
+		packet_.clear();
+		putVarintField(packet_, pb::packetTimestamp, timestamp);
+		putBytesField(packet_, pb::packetTrackEvent, event_);
+		putVarintField(packet_, pb::packetSequenceId, sequenceId(threadIndex));
+		flushPacket();
+	}
+
+private:
+	std::ostream &os_;
+	std::string packet_, event_, header_;	// reused between packets
+
+	static uint64_t trackUuid(unsigned threadIndex) { return 0x7065726600000000ull + threadIndex; }
+	// one sequence per thread: the timestamps are increasing within a thread, but not across the whole trace
+	static uint64_t sequenceId(unsigned threadIndex) { return threadIndex + 1; }
+
+	void flushPacket() {
+		header_.clear();
+		putVarint(header_, pb::tracePacket << 3 | 2);
+		putVarint(header_, packet_.size());
+		os_.write(header_.data(), header_.size());
+		os_.write(packet_.data(), packet_.size());
+	}
+};
+
+} // namespace
+
+void writeChromeTrace(std::vector<FrameCapture::frameData> const& frames, std::ostream &os) {
+	os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+	bool first = true;
+	std::vector<bool> namedThreads;
+	for (auto &f : frames) {
+		if (!first)
+			os << ",\n";
+		first = false;
+		if (namedThreads.size() <= f.threadIndex_)
+			namedThreads.resize(f.threadIndex_ + 1);
+		if (!namedThreads[f.threadIndex_]) {
+			namedThreads[f.threadIndex_] = true;
+			os << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":" << pid << ",\"tid\":" << f.threadIndex_ << ",\"args\":{\"name\":";
+			writeJsonString(os, threadName(f.threadIndex_).c_str());
+			os << "}},\n";
+		}
+		os << "{\"ph\":\"X\",\"name\":";
+		writeJsonString(os, f.name_);
+		os << ",\"cat\":\"" << (f.idleTime_ ? "idle" : f.deadTime_ ? "blocked" : "perf") << "\",\"ts\":";
+		writeMicroseconds(os, f.startTime_.time_since_epoch().count());
+		os << ",\"dur\":";
+		writeMicroseconds(os, (f.endTime_ - f.startTime_).count());
+		os << ",\"pid\":" << pid << ",\"tid\":" << f.threadIndex_ << "}";
+	}
+	os << "]}\n";
+}
+
+void writePerfettoTrace(std::vector<FrameCapture::frameData> const& frames, std::ostream &os) {
+	perfettoWriter writer(os);
+	// slices must nest on each track, so each thread keeps the end times of its open frames, and the ends are
+	// emitted as soon as the next frame on that thread starts after them
+	std::vector<std::vector<int64_t>> openEnds;
+	std::vector<bool> describedThreads;
+	for (auto &f : frames) {
+		unsigned t = f.threadIndex_;
+		if (describedThreads.size() <= t) {
+			describedThreads.resize(t + 1);
+			openEnds.resize(t + 1);
+		}
+		if (!describedThreads[t]) {
+			describedThreads[t] = true;
+			writer.threadTrack(t);
+		}
+		int64_t start = f.startTime_.time_since_epoch().count();
+		int64_t end = f.endTime_.time_since_epoch().count();
+		auto &stack = openEnds[t];
+		while (!stack.empty() && stack.back() <= start) {
+			writer.slice(pb::sliceEnd, stack.back(), t, nullptr);
+			stack.pop_back();
+		}
+		if (!stack.empty())
+			end = std::min(end, stack.back());	// a child can't outlive its parent
+		writer.slice(pb::sliceBegin, start, t, &f);
+		stack.push_back(end);
+	}
+	for (unsigned t=0; t<openEnds.size(); t++)
+		for (auto it = openEnds[t].rbegin(); it != openEnds[t].rend(); ++it)
+			writer.slice(pb::sliceEnd, *it, t, nullptr);
+}
+
+} // namespace trace
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
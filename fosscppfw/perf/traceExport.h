@@ -0,0 +1,31 @@
+/*
+ * traceExport.h
+ *
+ *  Streaming exporters for FrameCapture results into the formats of the standard trace viewers.
+ *  Both write straight to the stream in a single pass over the frames, without building the document in memory.
+ *  The frames are expected in the order returned by FrameCapture::getResults().
+ */
+#pragma once
+
+#ifdef ENABLE_PERF_PROFILING
+
+#include "frameCapture.h"
+
+#include <ostream>
+#include <vector>
+
+namespace perf {
+namespace trace {
+
+// Chrome Trace Event Format (JSON), for chrome://tracing, ui.perfetto.dev and speedscope.
+// Each frame becomes a complete ("X") event; blocked and idle frames get the "blocked" / "idle" category.
+void writeChromeTrace(std::vector<FrameCapture::frameData> const& frames, std::ostream &os);
+
+// Perfetto protobuf trace (a perfetto.protos.Trace message), for ui.perfetto.dev and trace_processor.
+// Each capture thread becomes a thread track, and each frame a slice on it. Open the stream in binary mode.
+void writePerfettoTrace(std::vector<FrameCapture::frameData> const& frames, std::ostream &os);
+
+} // namespace trace
+} // namespace perf
+
+#endif // ENABLE_PERF_PROFILING
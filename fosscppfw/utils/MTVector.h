@@ -11,20 +11,26 @@
 /*
  *  Multi-Threaded Vector
  *
- *  Defines a vector-like container which aims to provide thread-safe and lock-free insertions in 90% of the time
- *  When the preallocated space is exceeded, the insertion will lock, thus degrading performance (a warning will be printed)
+ *  Defines a vector-like container which provides thread-safe and lock-free insertions.
+ *  Elements are stored in segments that never move: the first one holds the preallocated capacity (rounded up to a power
+ *  of two), and each following segment is as big as all the previous ones together. Segments are allocated on demand
+ *  by whichever inserter needs them first (racing allocators settle it with a CAS), and an index is mapped to
+ *  its segment with a bit scan.
  *
- *  1. Inserting into the vector is thread safe and lock-free as long as the preallocated space doesn't run out
- *  	(after that it will perform lock for each insertion)
+ *  Each element also has a publication flag, set once it's fully constructed. Readers use these to find the published
+ *  prefix - the longest run of finished elements from the start - which they can read while insertions go on.
+ *
+ *  1. Inserting into the vector is thread safe and lock-free at any size
  *  2. iterating over the vector is NOT thread-safe - no insertions must take place during iteration.
+ *  	(use publishedSize() / getPublished() / drainUpTo() to read while other threads are inserting)
  *  3. clearing the vector is NOT thread-safe
  *  4. destruction is NOT thread-safe
  */
 
-#include "log.h"
 #include "xchg.h"
-#include <mutex>
 #include <atomic>
+#include <cstdint>
+#include <cstdlib>
 #include <vector>
 #include <utility>
 #include <thread>
@@ -36,29 +42,30 @@ class MTVector {
 public:
 
 	explicit MTVector(size_t preallocatedCapacity)
-		: capacity_(preallocatedCapacity)
-		, array_(static_cast<C*>(malloc(sizeof(C)*preallocatedCapacity)))
+		: firstSegmentBits_(segmentBitsFor(preallocatedCapacity))
 	{
+		segments_[0].store(allocSegment(0), std::memory_order_relaxed);
 	}
 
 	// this is NOT thread-safe !!!
 	// make sure no one is accessing the source object while calling this
 	MTVector(MTVector const& src)
-		: capacity_(src.capacity_)
-		, array_(static_cast<C*>(malloc(sizeof(C)*capacity_)))
-		, insertPtr_(src.insertPtr_.load())
-		, extra_(src.extra_)
+		: firstSegmentBits_(src.firstSegmentBits_)
 	{
-		for (size_t i=0; i<insertPtr_; i++) {
-			new (array_+i) C(src.array_[i]);
+		segments_[0].store(allocSegment(0), std::memory_order_relaxed);
+		size_t n = src.insertPtr_.load();
+		for (size_t i=0; i<n; i++) {
+			new (slot(i)) C(*src.slotIfAllocated(i));
+			publishedFlag(i)->store(1, std::memory_order_relaxed);
 		}
+		insertPtr_.store(n);
+		size_.store(n);
 	}
 
 	// this is NOT thread-safe !!!
 	// make sure no one is accessing the source object while calling this
 	MTVector(MTVector &&src)
-		: capacity_(0)
-		, array_(nullptr)
+		: firstSegmentBits_(src.firstSegmentBits_)
 	{
 		operator =(std::move(src));
 	}
@@ -66,30 +73,29 @@ public:
 	// this is NOT thread-safe !!!
 	// make sure no one is accessing the source object while calling this
 	MTVector& operator = (MTVector&& src) {
-		xchg(array_, src.array_);
-		xchg(capacity_, src.capacity_);
-		extra_.swap(src.extra_);
+		for (unsigned i=0; i<maxSegments; i++)
+			src.segments_[i].store(segments_[i].exchange(src.segments_[i].load(std::memory_order_relaxed)), std::memory_order_relaxed);
+		xchg(firstSegmentBits_, src.firstSegmentBits_);
 		src.insertPtr_.store(insertPtr_.exchange(src.insertPtr_.load(std::memory_order_consume), std::memory_order_acq_rel),
 				std::memory_order_release);
 		src.size_.store(size_.exchange(src.size_.load(std::memory_order_consume), std::memory_order_acq_rel),
 				std::memory_order_release);
+		src.published_.store(published_.exchange(src.published_.load()));
+		src.drained_.store(drained_.exchange(src.drained_.load()));
 		return *this;
 	}
 
 	~MTVector() {
 		clear();
-		free(array_);
-		array_ = nullptr;
+		for (auto &seg : segments_)
+			free(seg.exchange(nullptr, std::memory_order_relaxed));
 	}
 
 	class iterator : public std::iterator<std::random_access_iterator_tag, C> {
 	public:
 		C& operator *() {
 			assert(pos_ < parent_.size_.load(std::memory_order_consume));
-			if (extra_)
-				return parent_.extra_[offs_];
-			else
-				return parent_.array_[offs_];
+			return *parent_.slot(pos_);
 		}
 		iterator& operator++() {
 			move_to(pos_ + 1);
@@ -125,14 +131,10 @@ public:
 
 		void move_to(size_t pos) {
 			pos_ = pos;
-			extra_ = pos_ >= parent_.capacity_;
-			offs_ = extra_ ? pos_ - parent_.capacity_ : pos_;
 		}
 
 		MTVector<C>& parent_;
-		bool extra_ = false;
 		size_t pos_;
-		size_t offs_;
 	};
 
 	// thread safe - block insertions from all threads and return current contents
@@ -157,6 +159,71 @@ public:
 		return ret;
 	}
 
+	/**
+	 * Thread safe - returns the length of the published prefix: all elements below this index are fully inserted
+	 * and won't change anymore (unless drained). Never decreases, except through clear().
+	 */
+	size_t publishedSize() {
+		size_t watermark = published_.load(std::memory_order_acquire);
+		size_t end = insertPtr_.load(std::memory_order_acquire);
+		size_t p = watermark;
+		while (p < end) {
+			auto flag = publishedFlag(p);
+			if (!flag || !flag->load(std::memory_order_acquire))
+				break;
+			p++;
+		}
+		// advance the shared watermark so that the next reader doesn't scan the same flags again
+		while (p > watermark && !published_.compare_exchange_weak(watermark, p, std::memory_order_acq_rel))
+			;
+		return std::max(p, watermark);
+	}
+
+	/**
+	 * Thread safe, doesn't block insertions - the element at index i, which must be below a value returned by
+	 * publishedSize(). Unlike operator[], this can be used while other threads are inserting.
+	 */
+	C& publishedAt(size_t i) {
+		assert(i < published_.load(std::memory_order_acquire) && "publishedAt() index beyond publishedSize()");
+		return *slotIfAllocated(i);
+	}
+
+	/**
+	 * Thread safe, doesn't block insertions - appends copies of the published elements at indexes [from, publishedSize())
+	 * to out and returns the end index, which can be used as "from" for the next call to only get the new elements.
+	 * Don't use it on a range that is being drained concurrently.
+	 */
+	size_t getPublished(std::vector<C> &out, size_t from = 0) {
+		size_t end = publishedSize();
+		for (size_t i=from; i<end; i++)
+			out.push_back(*slotIfAllocated(i));
+		return end;
+	}
+
+	/**
+	 * Thread safe, doesn't block insertions - moves out all the published elements below index that haven't been drained yet.
+	 * Drained elements are left in the vector in a moved-from state (they still count in size()) until it's cleared.
+	 * Concurrent drains get disjoint ranges.
+	 */
+	std::vector<C> drainUpTo(size_t index = SIZE_MAX) {
+		std::vector<C> out;
+		size_t limit = std::min(index, publishedSize());
+		size_t from = drained_.load(std::memory_order_relaxed);
+		do {
+			if (from >= limit)
+				return out;
+		} while (!drained_.compare_exchange_weak(from, limit, std::memory_order_acq_rel));
+		out.reserve(limit - from);
+		for (size_t i=from; i<limit; i++)
+			out.push_back(std::move(*slotIfAllocated(i)));
+		return out;
+	}
+
+	// thread safe - the number of elements moved out by drainUpTo() so far
+	size_t drainedSize() const {
+		return drained_.load(std::memory_order_acquire);
+	}
+
 	// thread safe - returns index where the item was stored
 	size_t push_back(C const& c) {
 		return insert(c);
@@ -173,9 +240,9 @@ public:
 		return push_back(C(args...));
 	}
 
-	// thread safe
+	// thread safe - the size of the preallocated (first) segment; insertions are lock-free beyond it too
 	size_t getLockFreeCapacity() const {
-		return capacity_;
+		return segmentSize(0);
 	}
 
 	// thread safe-ish (may return non-up-to-date value if another thread is writing to the vector)
@@ -203,8 +270,7 @@ public:
 	// this is NOT thread-safe !!!
 	// make sure no one is pushing data into either vector when calling this
 	iterator end() {
-		auto lastIndex = insertPtr_.load(std::memory_order_acquire);
-		return iterator(*this, lastIndex >= capacity_ ? capacity_+extra_.size() : lastIndex);
+		return iterator(*this, insertPtr_.load(std::memory_order_acquire));
 	}
 
 	C& back() {
@@ -220,42 +286,100 @@ public:
 	// this is NOT thread-safe !!!
 	// make sure no one is pushing data into either vector when calling this
 	void clear() {
-		extra_.clear();
-		for (size_t i=0; i<std::min(capacity_, insertPtr_.load()); i++)
-			array_[i].~C();
+		size_t n = insertPtr_.load();
+		for (size_t i=0; i<n; i++) {
+			slot(i)->~C();
+			publishedFlag(i)->store(0, std::memory_order_relaxed);
+		}
 		insertPtr_.store(0, std::memory_order_release);
 		size_.store(0, std::memory_order_release);
+		published_.store(0, std::memory_order_release);
+		drained_.store(0, std::memory_order_release);
 	}
 
 private:
 	friend class iterator;
-	size_t capacity_;
-	C* array_;
+	static constexpr unsigned maxSegments = 64;
+
+	unsigned firstSegmentBits_;	// the first segment holds 1 << firstSegmentBits_ elements
+	std::atomic<C*> segments_[maxSegments] {};
 	std::atomic<size_t> insertPtr_ { 0 };
 	std::atomic<size_t> size_ { 0 };
-	std::vector<C> extra_;
-	std::mutex extraMtx_;
+	std::atomic<size_t> published_ { 0 };	// cached lower bound of publishedSize()
+	std::atomic<size_t> drained_ { 0 };
 	std::atomic<bool> insertionsBlocked_ {false};
 	std::atomic<int> insertionsRunning_ {0};
 
+	static unsigned segmentBitsFor(size_t capacity) {
+		unsigned bits = 0;
+		while ((size_t(1) << bits) < capacity)
+			bits++;
+		return bits;
+	}
+
+	// segment 0 holds [0, B), segment s > 0 holds [B << (s-1), B << s), where B is the size of the first segment
+	size_t segmentSize(unsigned segment) const {
+		return size_t(1) << (firstSegmentBits_ + (segment ? segment - 1 : 0));
+	}
+
+	unsigned segmentOf(size_t index, size_t &offset) const {
+		size_t high = index >> firstSegmentBits_;
+		if (high == 0) {
+			offset = index;
+			return 0;
+		}
+		unsigned segment = 64 - __builtin_clzll(high);	// 1 + the position of the highest set bit
+		offset = index - (size_t(1) << (firstSegmentBits_ + segment - 1));
+		return segment;
+	}
+
+	// a segment is a single block: the elements, followed by one (zeroed) publication flag per element
+	C* allocSegment(unsigned segment) const {
+		return static_cast<C*>(calloc(1, (sizeof(C) + 1) * segmentSize(segment)));
+	}
+
+	// returns the storage for the element at index, allocating its segment if needed
+	C* slot(size_t index) {
+		size_t offset;
+		unsigned segment = segmentOf(index, offset);
+		C* base = segments_[segment].load(std::memory_order_acquire);
+		if (!base) {
+			C* fresh = allocSegment(segment);
+			if (segments_[segment].compare_exchange_strong(base, fresh, std::memory_order_acq_rel))
+				base = fresh;
+			else
+				free(fresh);	// another inserter was faster; base now holds its segment
+		}
+		return base + offset;
+	}
+
+	C* slotIfAllocated(size_t index) const {
+		size_t offset;
+		unsigned segment = segmentOf(index, offset);
+		return segments_[segment].load(std::memory_order_acquire) + offset;
+	}
+
+	// returns nullptr if the element's segment hasn't been allocated yet
+	std::atomic<uint8_t>* publishedFlag(size_t index) const {
+		size_t offset;
+		unsigned segment = segmentOf(index, offset);
+		C* base = segments_[segment].load(std::memory_order_acquire);
+		if (!base)
+			return nullptr;
+		return reinterpret_cast<std::atomic<uint8_t>*>(base + segmentSize(segment)) + offset;
+	}
+
 	template<class ref>
 	size_t insert(ref&& r) {
 		while (insertionsBlocked_.load(std::memory_order_acquire))
 			std::this_thread::yield();
 		insertionsRunning_.fetch_add(1, std::memory_order_release);
 		auto writeIndex = insertPtr_.fetch_add(1, std::memory_order_relaxed);
-		if (writeIndex < capacity_) {
-			// this is our write index
-			new(array_ + writeIndex) C(std::forward<ref>(r));
-		} else {
-			// preallocated space filled up, must lock on the extra vector
-			LOGPREFIX("MTVECTOR");
-			LOGLN("PERFORMANCE WARNING: preallocated capacity reached, performing LOCK !!! capacity:" << capacity_<< "   size:" << size_.load(std::memory_order_consume));
-			std::lock_guard<std::mutex> lk(extraMtx_);
-			extra_.push_back(std::forward<ref>(r));
-			writeIndex = extra_.size() - 1 + capacity_;
-		}
+		// this is our write index
+		new(slot(writeIndex)) C(std::forward<ref>(r));
+		// counted before publishing, so that size() is never below a publishedSize() the flags allow
 		++size_;
+		publishedFlag(writeIndex)->store(1, std::memory_order_release);
 		insertionsRunning_.fetch_sub(1, std::memory_order_release);
 		return writeIndex;
 	}
@@ -9,8 +9,46 @@
 
 #ifndef DISABLE_THREAD_LOCAL
 
+#include <algorithm>
+#include <mutex>
+
 namespace ThreadLocalValuePrivate {
-	thread_local std::map<void*, vtype> mapThreadValues_;
+	thread_local threadSlots threadSlots_;
+	thread_local bool threadSlotsDestroyed_ = false;
+
+	namespace {
+		std::mutex idMutex_;
+		std::vector<unsigned> freeIds_;	// guarded by idMutex_
+		unsigned nextId_ = 0;	// guarded by idMutex_
+		uint64_t nextGeneration_ = 1;	// guarded by idMutex_
+	}
+
+	threadSlots::~threadSlots() {
+		for (auto &s : slots)
+			if (s.generation)
+				s.destroy(s);
+		threadSlotsDestroyed_ = true;
+	}
+
+	slotId acquireId() {
+		std::lock_guard<std::mutex> lk(idMutex_);
+		unsigned index;
+		if (!freeIds_.empty()) {
+			// reuse the lowest free id, to keep the per-thread arrays short
+			auto it = std::min_element(freeIds_.begin(), freeIds_.end());
+			index = *it;
+			*it = freeIds_.back();
+			freeIds_.pop_back();
+		} else {
+			index = nextId_++;
+		}
+		return { index, nextGeneration_++ };
+	}
+
+	void releaseId(unsigned index) {
+		std::lock_guard<std::mutex> lk(idMutex_);
+		freeIds_.push_back(index);
+	}
 }
 
-#endif // DISABLE_THREAD_LOCAL
\ No newline at end of file
+#endif // DISABLE_THREAD_LOCAL
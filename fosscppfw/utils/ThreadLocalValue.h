@@ -10,23 +10,59 @@
 
 #ifndef DISABLE_THREAD_LOCAL
 
-#include <map>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Each ThreadLocalValue gets a small integer id at construction (ids of destroyed instances are recycled), which indexes
+ * a dense per-thread array of slots, so accessing the value is O(1). A thread's value is created (as a copy of the
+ * initial value) the first time that thread accesses it, and destroyed when the thread exits or the ThreadLocalValue
+ * is destroyed, whichever comes first. Values that other threads still hold for a destroyed ThreadLocalValue are
+ * cleaned up lazily, when the id is reused or when those threads exit.
+ */
 
 namespace ThreadLocalValuePrivate {
-	using vtype=char[12];
-	extern thread_local std::map<void*, vtype> mapThreadValues_;
+	static constexpr size_t inlineSize = 16;
+
+	struct slot {
+		uint64_t generation = 0;	// 0 = empty; otherwise identifies the ThreadLocalValue instance that owns the value
+		void (*destroy)(slot&) = nullptr;
+		void* value = nullptr;	// heap-allocated value, for types that don't fit inline
+		alignas(std::max_align_t) unsigned char inlineStorage[inlineSize];
+	};
+
+	struct threadSlots {
+		std::vector<slot> slots;
+		~threadSlots();
+	};
+	extern thread_local threadSlots threadSlots_;
+	// set when the calling thread's threadSlots_ has been destroyed (at exit, the main thread's goes before the
+	// ThreadLocalValues with static storage); trivially destructible, so it stays readable after that
+	extern thread_local bool threadSlotsDestroyed_;
+
+	struct slotId {
+		unsigned index;
+		uint64_t generation;
+	};
+	slotId acquireId();
+	void releaseId(unsigned index);
 }
 
 template <class C>
 class ThreadLocalValue {
 public:
-	static_assert(sizeof(C) <= sizeof(ThreadLocalValuePrivate::vtype), "Not enough storage space for type!");
-
 	C get() const;
 	void set(C value);
 
+	// reference to the calling thread's value
+	C& ref() const;
+
 	ThreadLocalValue& operator=(C val) {
-		set(val);
+		set(std::move(val));
 		return *this;
 	}
 
@@ -35,36 +71,95 @@ public:
 	}
 
 	ThreadLocalValue();
-	explicit ThreadLocalValue(C initial);
+	explicit ThreadLocalValue(C initial);	// every thread's value starts out as a copy of initial
 	~ThreadLocalValue();
+
+	ThreadLocalValue(ThreadLocalValue const&) = delete;
+	ThreadLocalValue& operator=(ThreadLocalValue const&) = delete;
+
+private:
+	// trivially copyable values can live inside the slot, since the slot array may be relocated when it grows
+	static constexpr bool storedInline = std::is_trivially_copyable<C>::value
+		&& sizeof(C) <= ThreadLocalValuePrivate::inlineSize
+		&& alignof(C) <= alignof(std::max_align_t);
+
+	const ThreadLocalValuePrivate::slotId id_;
+	const C initial_;
+
+	static C* valuePtr(ThreadLocalValuePrivate::slot &s) {
+		return storedInline ? reinterpret_cast<C*>(s.inlineStorage) : static_cast<C*>(s.value);
+	}
+	static void destroySlot(ThreadLocalValuePrivate::slot &s);
+	C& initSlot() const;
 };
 
 // ------------------------------------ IMPLEMENTATION ----------------------------------------------
 
 template <class C>
-ThreadLocalValue<C>::ThreadLocalValue() {
-	set({});
+ThreadLocalValue<C>::ThreadLocalValue()
+	: ThreadLocalValue(C{}) {
 }
 
 template <class C>
-ThreadLocalValue<C>::ThreadLocalValue(C initial) {
-	set(initial);
+ThreadLocalValue<C>::ThreadLocalValue(C initial)
+	: id_(ThreadLocalValuePrivate::acquireId())
+	, initial_(std::move(initial)) {
 }
 
 template <class C>
 ThreadLocalValue<C>::~ThreadLocalValue() {
-	ThreadLocalValuePrivate::mapThreadValues_.erase((void*)this);
+	// if the thread's slots are gone, so is its value (~threadSlots destroyed it)
+	if (!ThreadLocalValuePrivate::threadSlotsDestroyed_) {
+		auto &slots = ThreadLocalValuePrivate::threadSlots_.slots;
+		if (id_.index < slots.size() && slots[id_.index].generation == id_.generation)
+			destroySlot(slots[id_.index]);
+	}
+	ThreadLocalValuePrivate::releaseId(id_.index);
+}
+
+template <class C>
+C& ThreadLocalValue<C>::ref() const {
+	auto &slots = ThreadLocalValuePrivate::threadSlots_.slots;
+	if (id_.index < slots.size() && slots[id_.index].generation == id_.generation)
+		return *valuePtr(slots[id_.index]);
+	return initSlot();
 }
 
 template <class C>
 C ThreadLocalValue<C>::get() const {
-	auto &val = ThreadLocalValuePrivate::mapThreadValues_[(void*)this];
-	return *((C*)&val);
+	return ref();
 }
 
 template <class C>
 void ThreadLocalValue<C>::set(C value) {
-	*((C*)&ThreadLocalValuePrivate::mapThreadValues_[(void*)this]) = value;
+	ref() = std::move(value);
+}
+
+template <class C>
+C& ThreadLocalValue<C>::initSlot() const {
+	auto &slots = ThreadLocalValuePrivate::threadSlots_.slots;
+	if (id_.index >= slots.size())
+		slots.resize(id_.index + 1);
+	auto &s = slots[id_.index];
+	if (s.generation)
+		s.destroy(s);	// left over from a destroyed ThreadLocalValue that had the same id
+	if constexpr (storedInline)
+		new (s.inlineStorage) C(initial_);
+	else
+		s.value = new C(initial_);
+	s.destroy = &destroySlot;
+	s.generation = id_.generation;
+	return *valuePtr(s);
+}
+
+template <class C>
+void ThreadLocalValue<C>::destroySlot(ThreadLocalValuePrivate::slot &s) {
+	if constexpr (storedInline)
+		reinterpret_cast<C*>(s.inlineStorage)->~C();
+	else
+		delete static_cast<C*>(s.value);
+	s.value = nullptr;
+	s.generation = 0;
 }
 
 #endif // DISABLE_THREAD_LOCAL
@@ -6,20 +6,47 @@
  */
 
 #include "ThreadPool.h"
+#include "work-stealing-deque.h"
+#include "parking-lot.h"
 #include "../perf/marker.h"
 
 #include <cassert>
-#include <numeric>
+#include <algorithm>
 #include <stdexcept>
+#include <utility>
 
-ThreadPool::ThreadPool(unsigned numberOfThreads, unsigned maxQueueSize)
-	: maxQueueSize_(maxQueueSize)
+namespace {
+	// identifies the pool (and, in work-stealing mode, the deque) owned by the current thread, if it is a pool worker
+	struct workerContext {
+		ThreadPool* pool = nullptr;
+		unsigned index = 0;
+		PoolTask* next = nullptr;	// shared-queue mode: a continuation made ready by the task we just ran, runs next on this thread
+	};
+	thread_local workerContext crtWorker_;
+
+	// number of failed attempts to find work before a worker goes to sleep
+	constexpr unsigned workerSpinRounds = 64;
+}
+
+ThreadPool::ThreadPool(unsigned numberOfThreads, unsigned maxQueueSize, Mode mode)
+	: mode_(mode)
+	, maxQueueSize_(maxQueueSize)
 {
 #ifdef DEBUG_THREADPOOL
 	LOGLN(__FUNCTION__);
 #endif
-	for (unsigned i=0; i<numberOfThreads; i++)
-		workers_.push_back(std::thread(std::bind(&ThreadPool::workerFunc, this)));
+	if (mode_ == Mode::WorkStealing) {
+		// all deques and shards must exist before any worker starts stealing
+		injectionShardCount_ = std::max(1u, numberOfThreads);
+		injectionShards_.reset(new injectionShard[injectionShardCount_]);
+		for (unsigned i=0; i<numberOfThreads; i++)
+			workerDeques_.emplace_back(new WorkStealingDeque<PoolTask*>());
+		for (unsigned i=0; i<numberOfThreads; i++)
+			workers_.push_back(std::thread(std::bind(&ThreadPool::workerFuncStealing, this, i)));
+	} else {
+		for (unsigned i=0; i<numberOfThreads; i++)
+			workers_.push_back(std::thread(std::bind(&ThreadPool::workerFunc, this)));
+	}
 #ifdef DEBUG_THREADPOOL
 	LOGLN(__FUNCTION__ << " finished.");
 #endif
@@ -28,32 +55,37 @@ ThreadPool::~ThreadPool() {
 	assert(stopped_ && "Thread pool has not been stopped before destruction!");
 }
 
-void ThreadPool::wait_impl(std::unique_lock<std::mutex> &poolLk) {
+void ThreadPool::wait_impl() {
 	// wait for all tasks to be processed
 	checkValidState();
+	if (isOwnWorkerThread())
+		throw std::runtime_error("Invalid operation on thread pool (waiting for the pool from one of its own workers would deadlock)");
 	queueBlocked_.store(true);
-	while (getTaskCount() > 0) {
-		poolLk.unlock();
-		std::this_thread::yield();
-		poolLk.lock();
+	// the last task to finish notifies us; tasks spawned by running tasks keep the count above zero meanwhile
+	parking::waitWhile(taskCount_, [](size_t count) { return count > 0; });
+	{
+		std::lock_guard<std::mutex> poolLk(poolMutex_);
+		queueBlocked_.store(false);
 	}
-	queueBlocked_.store(false);
+	condQueueSpace_.notify_all();
 }
 
 void ThreadPool::wait() {
-	std::unique_lock<std::mutex> poolLk(poolMutex_);
-	wait_impl(poolLk);
+	std::lock_guard<std::mutex> waitLk(waitMutex_);
+	wait_impl();
 }
 
 void ThreadPool::stop() {
 #ifdef DEBUG_THREADPOOL
 	LOGLN(__FUNCTION__);
 #endif
-	std::unique_lock<std::mutex> poolLk(poolMutex_);
-	wait_impl(poolLk);
+	std::lock_guard<std::mutex> waitLk(waitMutex_);
+	wait_impl();
 	// wait for all workers to finish and shuts down the threads in the pool
-	stopSignal_.store(true);
-	poolLk.unlock();
+	{
+		std::lock_guard<std::mutex> poolLk(poolMutex_);
+		stopSignal_.store(true);
+	}
 	condPendingTask_.notify_all();
 	for (auto &t : workers_)
 		t.join();
@@ -62,11 +94,12 @@ void ThreadPool::stop() {
 
 void ThreadPool::workerFunc() {
 	perf::setCrtThreadName("ThreadPoolWorker");
+	crtWorker_.pool = this;
 #ifdef DEBUG_THREADPOOL
 	LOGLN(__FUNCTION__ << " begin");
 #endif
 	while (!stopSignal_) {
-		PoolTaskHandle task(nullptr);
+		PoolTask* task = nullptr;
 		std::unique_lock<std::mutex> lk(poolMutex_);
 		auto pred = [this] { return stopSignal_ || !!!queuedTasks_.empty(); };
 		if (!pred()) {
@@ -83,54 +116,297 @@ void ThreadPool::workerFunc() {
 		assert(!!!queuedTasks_.empty());
 		task = queuedTasks_.front();
 		queuedTasks_.pop();
+		if (blockedProducers_.load(std::memory_order_relaxed) > 0)
+			condQueueSpace_.notify_one();
 		lk.unlock();
 
-		runningTaskCount_.fetch_add(1, std::memory_order_release);
-		std::lock_guard<std::mutex> workLk(task->workMutex_);
-		task->started_.store(true);
-		// do work...
-		do {
-			task->workFunc_();
-		} while (0);
-		task->finished_.store(true);
-		runningTaskCount_.fetch_sub(1, std::memory_order_release);
+		runTask(task);
+		while (PoolTask* next = std::exchange(crtWorker_.next, nullptr))
+			runTask(next);
+	}
+	crtWorker_ = {};
+}
+
+void ThreadPool::workerFuncStealing(unsigned workerIndex) {
+	perf::setCrtThreadName("ThreadPoolWorker");
+	crtWorker_.pool = this;
+	crtWorker_.index = workerIndex;
 #ifdef DEBUG_THREADPOOL
-	LOGLN(__FUNCTION__ << " finished work.");
+	LOGLN(__FUNCTION__ << " begin");
 #endif
+	unsigned failedRounds = 0;
+	while (true) {
+		PoolTask* pTask = findTask(workerIndex);
+		if (pTask) {
+			failedRounds = 0;
+			queuedTaskCount_.fetch_sub(1, std::memory_order_seq_cst);
+			// pairs with the seq_cst increment in submitStealing(): either we see the blocked producer, or it sees the freed slot
+			if (blockedProducers_.load(std::memory_order_seq_cst) > 0) {
+				std::lock_guard<std::mutex> lk(poolMutex_);
+				condQueueSpace_.notify_all();
+			}
+			runTask(pTask);
+			continue;
+		}
+		if (++failedRounds < workerSpinRounds) {
+			std::this_thread::yield();
+			continue;
+		}
+		failedRounds = 0;
+		std::unique_lock<std::mutex> lk(poolMutex_);
+		sleepingWorkers_.fetch_add(1, std::memory_order_seq_cst);
+		auto pred = [this] { return stopSignal_ || queuedTaskCount_.load(std::memory_order_seq_cst) > 0; };
+#ifdef DEBUG_THREADPOOL
+	LOGLN(__FUNCTION__ << " wait for work...");
+#endif
+		condPendingTask_.wait(lk, pred);
+		sleepingWorkers_.fetch_sub(1, std::memory_order_relaxed);
+		if (stopSignal_ && queuedTaskCount_.load(std::memory_order_acquire) == 0)
+			break;
 	}
+	crtWorker_ = {};
 }
 
-bool PoolTask::isFinished() const {
-	if (isCombined_) {
-		return std::accumulate(parts_.begin(), parts_.end(), true, [](bool finished, auto const& part) {
-			return finished && part->isFinished();
-		});
+PoolTask* ThreadPool::findTask(unsigned workerIndex) {
+	// 1. own deque (LIFO - most recently spawned work is the hottest in cache)
+	if (PoolTask* t = workerDeques_[workerIndex]->pop())
+		return t;
+	// 2. injection shards, starting with our home shard
+	for (unsigned i=0; i<injectionShardCount_; i++) {
+		auto &shard = injectionShards_[(workerIndex + i) % injectionShardCount_];
+		std::unique_lock<std::mutex> lk(shard.mutex, std::try_to_lock);
+		if (!lk.owns_lock() || shard.tasks.empty())
+			continue;
+		PoolTask* t = shard.tasks.front();
+		shard.tasks.pop_front();
+		return t;
+	}
+	// 3. steal from the other workers
+	unsigned n = workerDeques_.size();
+	for (unsigned i=1; i<n; i++) {
+		if (PoolTask* t = workerDeques_[(workerIndex + i) % n]->steal())
+			return t;
+	}
+	return nullptr;
+}
+
+void ThreadPool::wakeWorker() {
+	// pairs with the seq_cst increment of sleepingWorkers_ in the worker: either we see the sleeper here,
+	// or the sleeper sees the updated queuedTaskCount_ in its wait predicate
+	if (sleepingWorkers_.load(std::memory_order_seq_cst) > 0) {
+		std::lock_guard<std::mutex> lk(poolMutex_);
+		condPendingTask_.notify_one();
+	}
+}
+
+void ThreadPool::runTask(PoolTask* task) {
+	// take over the queue's reference, the task must stay alive until we're done with it even if all user handles are dropped
+	PoolTaskHandle keepAlive(std::move(task->self_));
+	// do work...
+	do {
+		task->workFunc_();
+	} while (0);
+	task->workFunc_.reset(); // release captured state now rather than when the last handle goes away
+	if (task->detached_) {
+		// nobody can wait on a detached task
+		task->~PoolTask();
+		taskFreelist_->deallocate(task, sizeof(PoolTask));
 	} else {
-		return finished_.load(std::memory_order::memory_order_acquire);
+		task->markFinished();
 	}
+	if (taskCount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		parking::notifyAll(&taskCount_);
+#ifdef DEBUG_THREADPOOL
+	LOGLN(__FUNCTION__ << " finished work.");
+#endif
 }
 
-void PoolTask::wait() {
+void ThreadPool::submit(PoolTask* task) {
+	// counted before it becomes visible, so that a worker finishing it can never underflow the counter
+	taskCount_.fetch_add(1, std::memory_order_seq_cst);
+	try {
+		if (mode_ == Mode::WorkStealing)
+			submitStealing(task);
+		else
+			submitShared(task);
+	} catch (...) {
+		// the task never made it into a queue, drop the ownership we were given
+		if (taskCount_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			parking::notifyAll(&taskCount_);
+		if (task->detached_) {
+			task->~PoolTask();
+			taskFreelist_->deallocate(task, sizeof(PoolTask));
+		} else {
+			task->self_.reset();
+		}
+		throw;
+	}
+}
+
+void ThreadPool::submitShared(PoolTask* task) {
+	std::unique_lock<std::mutex> lk(poolMutex_);
+	// Tasks spawned by our own workers are held back neither by wait(), which is waiting for them to finish, nor by
+	// maxQueueSize_: if all the workers slept here waiting for queue space, nobody would be left to make some.
+	bool ownWorker = isOwnWorkerThread();
+	auto mustBlock = [&] {
+		return !ownWorker && (queueBlocked_.load(std::memory_order_acquire) || queuedTasks_.size() >= maxQueueSize_);
+	};
+	if (mustBlock()) {
+		blockedProducers_.fetch_add(1, std::memory_order_relaxed);
+		condQueueSpace_.wait(lk, [&] { return !mustBlock(); });
+		blockedProducers_.fetch_sub(1, std::memory_order_relaxed);
+	}
 #ifdef DEBUG_THREADPOOL
-	LOGLN(__FUNCTION__ << " waiting for task...");
+	LOGLN(__FUNCTION__ << " mutex acquired.");
 #endif
+	checkValidState();
+	queuedTasks_.push(task);
+	//lk.unlock(); -- TODO unlocking the mutex here causes the notify_one() below to sometimes hang
+#ifdef DEBUG_THREADPOOL
+	LOGLN(__FUNCTION__ << " mutex unlocked. notifying...");
+#endif
+	condPendingTask_.notify_one();
+#ifdef DEBUG_THREADPOOL
+	LOGLN(__FUNCTION__ << " notify_one() returned");
+#endif
+}
+
+void ThreadPool::submitStealing(PoolTask* task) {
+	if (crtWorker_.pool == this) {
+		// spawned from one of our own workers - goes into the worker's own deque.
+		// this path ignores maxQueueSize_ and queueBlocked_, otherwise a task waiting on its children could deadlock the pool
+		queuedTaskCount_.fetch_add(1, std::memory_order_seq_cst);
+		workerDeques_[crtWorker_.index]->push(task);
+		wakeWorker();
+		return;
+	}
+	auto mustBlock = [this] {
+		return queueBlocked_.load(std::memory_order_seq_cst) || queuedTaskCount_.load(std::memory_order_seq_cst) >= maxQueueSize_;
+	};
+	if (mustBlock()) {
+		std::unique_lock<std::mutex> lk(poolMutex_);
+		blockedProducers_.fetch_add(1, std::memory_order_seq_cst);
+		condQueueSpace_.wait(lk, [&] { return !mustBlock(); });
+		blockedProducers_.fetch_sub(1, std::memory_order_relaxed);
+	}
+	checkValidState();
+	// counted before it becomes visible, so that a worker taking it can never underflow the counter
+	queuedTaskCount_.fetch_add(1, std::memory_order_seq_cst);
+	auto &shard = injectionShards_[nextInjectionShard_.fetch_add(1, std::memory_order_relaxed) % injectionShardCount_];
 	{
-		while (!started_)
-			std::this_thread::yield();
+		std::lock_guard<std::mutex> lk(shard.mutex);
+		shard.tasks.push_back(task);
+	}
+	wakeWorker();
+}
+
+PoolTaskHandle PoolTask::whenAll(std::vector<PoolTaskHandle> &&handles) {
+	PoolTaskHandle combined(new PoolTask(ctorTag{}, function_type{}));
+	combined->isCombined_ = true;
+	combined->dependOn(handles);
+	return combined;
+}
+
+PoolTaskHandle PoolTask::whenAny(std::vector<PoolTaskHandle> &&handles) {
+	if (handles.empty())
+		return empty();
+	PoolTaskHandle combined(new PoolTask(ctorTag{}, function_type{}));
+	combined->isCombined_ = true;
+	// the first part to finish releases the latch, the others find it at zero and do nothing
+	combined->pendingParts_.store(1, std::memory_order_relaxed);
+	for (auto &part : handles) {
+		if (!part->addDependent(combined)) {
+			combined->partFinished();
+			break;
+		}
+	}
+	return combined;
+}
+
+void PoolTask::dependOn(std::vector<PoolTaskHandle> const& predecessors) {
+	// one extra count held by us, so that the task can't become ready while we're still registering it with its predecessors
+	pendingParts_.store(predecessors.size() + 1, std::memory_order_relaxed);
+	PoolTaskHandle self = shared_from_this();
+	for (auto &p : predecessors) {
+		if (!p->addDependent(self))
+			partFinished();
+	}
+	partFinished();
+}
+
+bool PoolTask::addDependent(PoolTaskHandle const& dependent) {
+	std::lock_guard<std::mutex> lk(workMutex_);
+	if (finished_.load(std::memory_order_relaxed))
+		return false;
+	dependents_.push_back(dependent);
+	return true;
+}
+
+void PoolTask::markFinished() {
+	std::vector<PoolTaskHandle> dependents;
+	{
+		std::lock_guard<std::mutex> lk(workMutex_);
+		finished_.store(true, std::memory_order_release);
+		dependents.swap(dependents_);
+	}
+	parking::notifyAll(&finished_);
+	for (auto &d : dependents)
+		d->partFinished();
+}
+
+void PoolTask::partFinished() {
+	unsigned pending = pendingParts_.load(std::memory_order_relaxed);
+	do {
+		if (pending == 0)
+			return;	// whenAny() latch that was already released
+	} while (!pendingParts_.compare_exchange_weak(pending, pending - 1, std::memory_order_acq_rel));
+	if (pending == 1)
+		dependenciesMet();
+}
+
+void PoolTask::dependenciesMet() {
+	if (pool_) {
+		// a continuation - now it can go into the pool's queues
+		self_ = shared_from_this();
+		pool_->submitReady(this);
+	} else {
+		markFinished();
+	}
+}
+
+void ThreadPool::submitReady(PoolTask* task) {
+	if (!isOwnWorkerThread()) {
+		submit(task);
+		return;
+	}
+	// made ready by one of our workers: keep it on that worker, whose cache is hot with the predecessor's data.
+	// Like other submissions from workers, this ignores maxQueueSize_ so that the pool can't deadlock on itself
+	taskCount_.fetch_add(1, std::memory_order_seq_cst);
+	if (mode_ == Mode::WorkStealing) {
+		submitStealing(task);	// goes on top of the worker's own deque
+	} else if (!crtWorker_.next) {
+		crtWorker_.next = task;
+	} else {
+		{
+			std::lock_guard<std::mutex> lk(poolMutex_);
+			queuedTasks_.push(task);
+		}
+		condPendingTask_.notify_one();
 	}
+}
+
+bool PoolTask::isFinished() const {
+	return finished_.load(std::memory_order_acquire);
+}
+
+void PoolTask::wait() {
 #ifdef DEBUG_THREADPOOL
-	LOGLN(__FUNCTION__ << " task is started.");
+	LOGLN(__FUNCTION__ << " waiting for task...");
 #endif
-	if (isCombined_) {
-		while (!isFinished())
-			std::this_thread::yield();
-	} else {
-		std::lock_guard<std::mutex> lk(workMutex_);
-		assert(finished_);
+	parking::waitWhileEqual(finished_, false);
 #ifdef DEBUG_THREADPOOL
-		LOGLN(__FUNCTION__ << " task is finished.");
+	LOGLN(__FUNCTION__ << " task is finished.");
 #endif
-	}
 }
 
 void ThreadPool::checkValidState() {
@@ -138,6 +414,10 @@ void ThreadPool::checkValidState() {
 		throw std::runtime_error("Invalid operation on thread pool (pool is stopping)");
 }
 
+bool ThreadPool::isOwnWorkerThread() const {
+	return crtWorker_.pool == this;
+}
+
 size_t ThreadPool::getTaskCount() const {
-	return queuedTasks_.size() + runningTaskCount_.load(std::memory_order_acquire);
+	return taskCount_.load(std::memory_order_acquire);
 }
\ No newline at end of file
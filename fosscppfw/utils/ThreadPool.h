@@ -16,6 +16,8 @@
 #include <atomic>
 #include <thread>
 #include <utility>
+#include <deque>
+#include <memory>
 
 //#define DEBUG_THREADPOOL	// to enable debug logs
 
@@ -23,11 +25,27 @@
 #include "log.h"
 #endif
 
+#include "inline-function.h"
+#include "block-freelist.h"
+
+// size of the buffer used to store a task's callable (including its captured arguments) inside the PoolTask object.
+// Bigger callables still work with queueTask(), but require an additional heap allocation.
+#ifndef THREADPOOL_TASK_INLINE_SIZE
+#define THREADPOOL_TASK_INLINE_SIZE 64
+#endif
+
+template<class T> class WorkStealingDeque;
+
+class ThreadPool;
 class PoolTask;
 using PoolTaskHandle = std::shared_ptr<PoolTask>;
 
-class PoolTask {
+class PoolTask : public std::enable_shared_from_this<PoolTask> {
+	struct ctorTag { explicit ctorTag() = default; };	// only friends can construct tasks
 public:
+	using function_type = InlineFunction<THREADPOOL_TASK_INLINE_SIZE>;
+
+	// blocks until the task has finished; spins for a short while, then parks the calling thread
 	void wait();
 	bool isFinished() const;
 
@@ -35,92 +53,164 @@ public:
 		return PoolTaskHandle(new PoolTask(true));
 	}
 
+	// returns a task that finishes when all the given tasks have finished
+	static PoolTaskHandle whenAll(std::vector<PoolTaskHandle> &&handles);
+
+	// returns a task that finishes as soon as any of the given tasks has finished
+	static PoolTaskHandle whenAny(std::vector<PoolTaskHandle> &&handles);
+
 	static PoolTaskHandle combine(std::vector<PoolTaskHandle> &&handles) {
-		return PoolTaskHandle(new PoolTask(std::move(handles)));
+		return whenAll(std::move(handles));
+	}
+
+	// queues a task into the pool once this one has finished, without blocking any thread in the meantime.
+	// If this task is finished by one of the pool's workers, the continuation runs next on that same worker.
+	template<class F, class... Args>
+	PoolTaskHandle then(ThreadPool &pool, F task, Args... args);
+
+	// public so that std::allocate_shared can reach it, but only callable by friends (ctorTag is private)
+	PoolTask(ctorTag, function_type &&func)
+		: workFunc_(std::move(func)) {
 	}
 
 private:
-	std::mutex workMutex_;
-	std::atomic<bool> started_ { false };
+	std::mutex workMutex_;	// guards the transition to finished and the dependents_ list
 	std::atomic<bool> finished_ { false };
-	std::function<void()> workFunc_;
+	function_type workFunc_;
 
 	bool isCombined_ = false;
-	std::vector<PoolTaskHandle> parts_;
+	bool detached_ = false;	// no handle exists, the pool owns the task and recycles it after running it
+	std::atomic<unsigned> pendingParts_ { 0 };	// countdown latch of a combined task or continuation
+	std::vector<PoolTaskHandle> dependents_;	// combined tasks and continuations that wait for this one
+	ThreadPool* pool_ = nullptr;	// continuations only: the pool the task is submitted to once its predecessors have finished
+
+	PoolTaskHandle self_;	// keeps the task alive while it sits in the pool's queues (which only hold raw pointers)
 
 	friend class ThreadPool;
-	explicit PoolTask(decltype(workFunc_) func)
-		: workFunc_(func) {
-	}
 
 	explicit PoolTask(bool empty)
-		: started_(true)
-		, finished_(true)
+		: finished_(true)
 	{ }
 
-	explicit PoolTask(std::vector<PoolTaskHandle> &&parts)
-		: started_(true)
-		, isCombined_(true)
-		, parts_(std::move(parts))
-	{ }
+	// returns false (and doesn't register the dependent) if this task has already finished
+	bool addDependent(PoolTaskHandle const& dependent);
+	// registers the task with all its predecessors; the task becomes ready once pendingParts_ drops to zero
+	void dependOn(std::vector<PoolTaskHandle> const& predecessors);
+	void markFinished();
+	void partFinished();
+	void dependenciesMet();
 };
 
 class ThreadPool {
 public:
-	ThreadPool(unsigned numberOfThreads, unsigned maxQueueSize);
+	enum class Mode {
+		SharedQueue,	// all tasks go through a single queue guarded by the pool mutex
+		WorkStealing,	// each worker owns a lock-free deque; idle workers steal from each other,
+						// external submissions go through a sharded injection queue
+	};
+
+	ThreadPool(unsigned numberOfThreads, unsigned maxQueueSize, Mode mode = Mode::SharedQueue);
 	~ThreadPool();	// make sure you call stop() before destruction
 
 	void stop(); // waits for all tasks to finish processing, waits for all workers to finish and shuts down the threads in the pool
 
-	void wait(); // waits for all tasks to finish processing
+	void wait(); // waits for all tasks to finish processing (blocks new submissions from outside the pool meanwhile)
 
 	size_t getTaskCount() const; // returns the number of tasks that are either running or waiting in the queue. May return a non-up-to-date value.
 
 	template<class F, class... Args>
 	PoolTaskHandle queueTask(F task, Args... args) {
-		std::unique_lock<std::mutex> lk(poolMutex_);
-		while (queueBlocked_.load(std::memory_order_acquire) || queuedTasks_.size() >= maxQueueSize_) {
-			lk.unlock();
-			std::this_thread::yield();
-			lk.lock();
-		}
-#ifdef DEBUG_THREADPOOL
-	LOGLN(__FUNCTION__ << " mutex acquired.");
-#endif
-		checkValidState();
-		auto handle = std::shared_ptr<PoolTask>(new PoolTask([=] () mutable { task(args...); }));
-		queuedTasks_.push(handle);
-		//lk.unlock(); -- TODO unlocking the mutex here causes the notify_one() below to sometimes hang
-#ifdef DEBUG_THREADPOOL
-	LOGLN(__FUNCTION__ << " mutex unlocked. notifying...");
-#endif
-		condPendingTask_.notify_one();
-#ifdef DEBUG_THREADPOOL
-	LOGLN(__FUNCTION__ << " notify_one() returned");
-#endif
+		// the task object and the shared_ptr control block live in a single block recycled through taskFreelist_
+		auto handle = std::allocate_shared<PoolTask>(FreelistAllocator<PoolTask>(taskFreelist_),
+			PoolTask::ctorTag{}, [=] () mutable { task(args...); });
+		handle->self_ = handle;
+		submit(handle.get());
+		return handle;
+	}
+
+	// Fire-and-forget version of queueTask(): no handle is created, use wait() to wait for detached tasks.
+	// The callable (with its arguments) must fit into THREADPOOL_TASK_INLINE_SIZE, which makes this path
+	// allocation-free once the pool's task freelist has warmed up.
+	template<class F, class... Args>
+	void queueDetached(F task, Args... args) {
+		auto func = [=] () mutable { task(args...); };
+		static_assert(PoolTask::function_type::fitsInline<decltype(func)>(),
+			"task is too big for allocation-free submission, increase THREADPOOL_TASK_INLINE_SIZE or use queueTask()");
+		PoolTask* t = new (taskFreelist_->allocate(sizeof(PoolTask))) PoolTask(PoolTask::ctorTag{}, std::move(func));
+		t->detached_ = true;
+		submit(t);
+	}
+
+	// Queues a task that starts only after all the predecessors have finished. No thread is blocked while waiting
+	// for them; if the last predecessor is finished by one of this pool's workers, the task runs next on that worker.
+	template<class F, class... Args>
+	PoolTaskHandle queueAfter(std::vector<PoolTaskHandle> const& predecessors, F task, Args... args) {
+		auto handle = std::allocate_shared<PoolTask>(FreelistAllocator<PoolTask>(taskFreelist_),
+			PoolTask::ctorTag{}, [=] () mutable { task(args...); });
+		handle->pool_ = this;
+		handle->dependOn(predecessors);
 		return handle;
 	}
 
 	unsigned getThreadCount() const { return workers_.size(); }
 
+	Mode getMode() const { return mode_; }
+
 protected:
-	std::queue<PoolTaskHandle> queuedTasks_;
+	friend class PoolTask;
+
+	const Mode mode_;
+	std::queue<PoolTask*> queuedTasks_;
 	unsigned maxQueueSize_;
 	std::mutex poolMutex_;
 	std::condition_variable condPendingTask_;
+	std::condition_variable condQueueSpace_;	// producers blocked by a full queue or by wait() sleep here
+	std::atomic<int> blockedProducers_ { 0 };	// only changed while holding poolMutex_
+	std::mutex waitMutex_;	// serializes wait() and stop()
 	std::vector<std::thread> workers_;
-	std::atomic<int> runningTaskCount_ {0};
+	std::atomic<size_t> taskCount_ { 0 };	// tasks either queued or running
 	std::atomic<bool> queueBlocked_ { false };	// pool is waiting for all tasks completion, calls to queueTask are blocked until operation finishes
 	std::atomic<bool> stopSignal_ { false };	// signal workers to stop
 	std::atomic<bool> stopRequested_ { false };	// stop requested by user
 	std::atomic<bool> stopped_ { false };
 
+	// blocks big enough for a PoolTask together with its shared_ptr control block
+	std::shared_ptr<BlockFreelist> taskFreelist_ { std::make_shared<BlockFreelist>(sizeof(PoolTask) + 4 * sizeof(void*)) };
+
+	// work-stealing mode only:
+	struct injectionShard {
+		alignas(64) std::mutex mutex;
+		std::deque<PoolTask*> tasks;
+	};
+	std::vector<std::unique_ptr<WorkStealingDeque<PoolTask*>>> workerDeques_;
+	std::unique_ptr<injectionShard[]> injectionShards_;
+	unsigned injectionShardCount_ = 0;
+	std::atomic<unsigned> nextInjectionShard_ { 0 };
+	std::atomic<size_t> queuedTaskCount_ { 0 };	// tasks sitting in deques or injection shards
+	std::atomic<int> sleepingWorkers_ { 0 };
+
+	// takes ownership of the task; it is kept alive either by task->self_ or, for detached tasks, by the pool
+	void submit(PoolTask* task);
+	void submitShared(PoolTask* task);
+	void submitStealing(PoolTask* task);
+	// submits a continuation whose predecessors have just finished
+	void submitReady(PoolTask* task);
+
 	void workerFunc();
+	void workerFuncStealing(unsigned workerIndex);
+	PoolTask* findTask(unsigned workerIndex);
+	void wakeWorker();
+	void runTask(PoolTask* task);
+	bool isOwnWorkerThread() const;
 
 	void checkValidState();
-	void wait_impl(std::unique_lock<std::mutex> &lk);
+	void wait_impl();
 };
 
 
+template<class F, class... Args>
+PoolTaskHandle PoolTask::then(ThreadPool &pool, F task, Args... args) {
+	return pool.queueAfter({ shared_from_this() }, task, args...);
+}
 
 #endif /* UTILS_THREADPOOL_H_ */
@@ -1,8 +1,10 @@
 #pragma once
 
-#include "semaphore.h"
+#include "mpmc-ring-queue.h"
 #include <mutex>
+#include <condition_variable>
 #include <deque>
+#include <iterator>
 
 namespace detail {
 
@@ -10,15 +12,17 @@ template<class T>
 class AsyncQueueImpl {
 public:
 	void push(T && t) {
-		std::lock_guard<std::mutex> lock(queueMutex_);
-		queue_.push_back(std::forward<T&&>(t));
-		semaphore_.notify();
+		{
+			std::lock_guard<std::mutex> lock(queueMutex_);
+			queue_.push_back(std::forward<T&&>(t));
+		}
+		notEmpty_.notify_one();
 	}
 
 	T pop() {
-		semaphore_.wait();
-		std::lock_guard<std::mutex> lock(queueMutex_);
-		T result = queue_.front();
+		std::unique_lock<std::mutex> lock(queueMutex_);
+		notEmpty_.wait(lock, [this] { return !queue_.empty(); });
+		T result = std::move(queue_.front());
 		queue_.pop_front();
 		return result;
 	}
@@ -29,33 +33,69 @@ public:
 			std::lock_guard<std::mutex> lock(queueMutex_);
 			queue_.swap(replacement);
 		}
-		return {replacement.begin(), replacement.end()};
+		return {std::make_move_iterator(replacement.begin()), std::make_move_iterator(replacement.end())};
 	}
 
 private:
-	Semaphore semaphore_;
 	std::mutex queueMutex_;
+	std::condition_variable notEmpty_;
 	std::deque<T> queue_;
 };
 
+template<class T>
+class AsyncQueueRingImpl {
+public:
+	explicit AsyncQueueRingImpl(size_t capacity = 1024)
+		: ring_(capacity) {
+	}
+
+	void push(T && t) {
+		ring_.push(std::forward<T&&>(t));
+	}
+
+	T pop() {
+		return ring_.pop();
+	}
+
+	std::vector<T> drain() {
+		std::vector<T> result;
+		while (ring_.try_pop_n(std::back_inserter(result), ring_.capacity()) > 0)
+			;
+		return result;
+	}
+
+private:
+	MPMCRingQueue<T> ring_;
+};
+
 } // namespace detail
 
-template<class T>
-AsyncQueue<T>::AsyncQueue()
-	: pImpl_(new detail::AsyncQueueImpl<T>())
+template<class T, class Impl>
+AsyncQueue<T, Impl>::AsyncQueue()
+	: pImpl_(new Impl())
 {}
 
-template<class T>
-void AsyncQueue<T>::push(T && t) {
+template<class T, class Impl>
+AsyncQueue<T, Impl>::AsyncQueue(size_t capacity)
+	: pImpl_(new Impl(capacity))
+{}
+
+template<class T, class Impl>
+AsyncQueue<T, Impl>::~AsyncQueue() {
+	delete pImpl_;
+}
+
+template<class T, class Impl>
+void AsyncQueue<T, Impl>::push(T && t) {
 	pImpl_->push(std::forward<T&&>(t));
 }
 
-template<class T>
-T AsyncQueue<T>::pop() {
+template<class T, class Impl>
+T AsyncQueue<T, Impl>::pop() {
 	return pImpl_->pop();
 }
 
-template<class T>
-std::vector<T> AsyncQueue<T>::drain() {
+template<class T, class Impl>
+std::vector<T> AsyncQueue<T, Impl>::drain() {
 	return pImpl_->drain();
-}
\ No newline at end of file
+}
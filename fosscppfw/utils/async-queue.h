@@ -1,17 +1,30 @@
 #pragma once
 
 #include <vector>
+#include <cstddef>
 
 namespace detail {
 template<class T>
 class AsyncQueueImpl;
+template<class T>
+class AsyncQueueRingImpl;
 }
 
-template<class T>
+/**
+ * Impl selects the backend:
+ *  - detail::AsyncQueueImpl (default) - unbounded, a mutex-guarded deque
+ *  - detail::AsyncQueueRingImpl (see AsyncRingQueue below) - bounded lock-free ring buffer, push() blocks while it's full
+ */
+template<class T, class Impl = detail::AsyncQueueImpl<T>>
 class AsyncQueue {
 public:
 	AsyncQueue();
+	/**
+	 * Only for bounded backends: creates a queue that can hold at least capacity elements.
+	 */
+	explicit AsyncQueue(size_t capacity);
 	AsyncQueue(const AsyncQueue&) = delete;
+	~AsyncQueue();
 
 	/**
 	 * Pushes a new element to the queue.
@@ -34,7 +47,14 @@ public:
 	std::vector<T> drain();
 
 private:
-	detail::AsyncQueueImpl<T>* pImpl_;
+	Impl* pImpl_;
 };
 
-#include "async-queue-detail.h"
\ No newline at end of file
+/**
+ * AsyncQueue backed by a lock-free bounded MPMC ring buffer (see mpmc-ring-queue.h).
+ * Use this for high-throughput hand-offs between threads; the default capacity is 1024 elements.
+ */
+template<class T>
+using AsyncRingQueue = AsyncQueue<T, detail::AsyncQueueRingImpl<T>>;
+
+#include "async-queue-detail.h"
@@ -0,0 +1,552 @@
+/*
+ * binary-log.cpp
+ *
+ *  Binary file layout (host byte order):
+ *		header:	"FCBL" + uint32_t version
+ *		then a sequence of entries, each starting with a uint8_t kind:
+ *			site:		uint32_t id, int32_t level, int32_t line, string file, string format
+ *			record:		uint32_t siteId, uint32_t threadIndex, uint64_t timestamp, uint32_t argBytes, args
+ *			dropped:	uint32_t threadIndex, uint64_t count
+ *		(strings are a uint32_t length followed by the characters; args are encoded as in the rings, see binary-log.h)
+ *	A site is always written before the first record that uses it.
+ */
+
+#include "binary-log.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <ctime>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+namespace {
+
+const char fileMagic[4] = { 'F', 'C', 'B', 'L' };
+const uint32_t fileVersion = 1;
+
+enum entryKind : uint8_t {
+	ENTRY_SITE = 1,
+	ENTRY_RECORD,
+	ENTRY_DROPPED
+};
+
+struct siteInfo {
+	int level;
+	const char* format;
+	const char* file;
+	int line;
+};
+
+// a decoded argument
+struct argValue {
+	uint8_t type;
+	int64_t i;
+	uint64_t u;
+	double d;
+	std::string_view s;
+};
+
+// reads the arguments encoded in [p, end); returns false if they're malformed
+bool parseArgs(const char* p, const char* end, std::vector<argValue> &out) {
+	while (p < end) {
+		argValue a {};
+		a.type = (uint8_t)*p++;
+		size_t need = a.type == binaryLog::ARG_STRING ? sizeof(uint32_t)
+			: (a.type == binaryLog::ARG_CHAR || a.type == binaryLog::ARG_BOOL) ? 1 : 8;
+		if (size_t(end - p) < need)
+			return false;
+		switch (a.type) {
+		case binaryLog::ARG_INT: std::memcpy(&a.i, p, 8); break;
+		case binaryLog::ARG_UINT: std::memcpy(&a.u, p, 8); break;
+		case binaryLog::ARG_DOUBLE: std::memcpy(&a.d, p, 8); break;
+		case binaryLog::ARG_CHAR:
+		case binaryLog::ARG_BOOL: a.i = *p; break;
+		case binaryLog::ARG_STRING: {
+			uint32_t len;
+			std::memcpy(&len, p, sizeof(len));
+			if (size_t(end - p - sizeof(len)) < len)
+				return false;
+			a.s = std::string_view(p + sizeof(len), len);
+			need += len;
+			break;
+		}
+		default:
+			return false;
+		}
+		p += need;
+		out.push_back(a);
+	}
+	return true;
+}
+
+void writeArg(std::ostream &os, argValue const& a) {
+	switch (a.type) {
+	case binaryLog::ARG_INT: os << a.i; break;
+	case binaryLog::ARG_UINT: os << a.u; break;
+	case binaryLog::ARG_DOUBLE: os << a.d; break;
+	case binaryLog::ARG_CHAR: os << (char)a.i; break;
+	case binaryLog::ARG_BOOL: os << (a.i ? "true" : "false"); break;
+	case binaryLog::ARG_STRING: os << a.s; break;
+	}
+}
+
+// replaces each "{}" in the format with the next argument; extra arguments are appended
+void formatMessage(std::ostream &os, const char* format, std::vector<argValue> const& args) {
+	size_t next = 0;
+	for (const char* p = format; *p; p++) {
+		if (p[0] == '{' && p[1] == '}' && next < args.size()) {
+			writeArg(os, args[next++]);
+			p++;
+		} else
+			os << *p;
+	}
+	for (; next < args.size(); next++) {
+		os << " ";
+		writeArg(os, args[next]);
+	}
+}
+
+void writeJsonString(std::ostream &os, std::string_view s) {
+	os << '"';
+	for (char c : s) {
+		switch (c) {
+		case '"': os << "\\\""; break;
+		case '\\': os << "\\\\"; break;
+		case '\n': os << "\\n"; break;
+		case '\r': os << "\\r"; break;
+		case '\t': os << "\\t"; break;
+		default:
+			if ((unsigned char)c < 0x20)
+				os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c << std::dec << std::setfill(' ');
+			else
+				os << c;
+		}
+	}
+	os << '"';
+}
+
+void writeJsonArg(std::ostream &os, argValue const& a) {
+	switch (a.type) {
+	case binaryLog::ARG_CHAR: writeJsonString(os, std::string_view((const char*)&a.i, 1)); break;
+	case binaryLog::ARG_STRING: writeJsonString(os, a.s); break;
+	case binaryLog::ARG_DOUBLE:
+		os << std::setprecision(17) << a.d << std::setprecision(6);
+		break;
+	default: writeArg(os, a);
+	}
+}
+
+// "yyyy-mm-dd hh:mm:ss.uuuuuu"
+void writeTimestamp(std::ostream &os, uint64_t nanosec) {
+	time_t t = nanosec / 1000000000;
+	struct tm tmNow;
+	localtime_r(&t, &tmNow);
+	char buf[32];
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tmNow);
+	os << buf << "." << std::setw(6) << std::setfill('0') << (nanosec % 1000000000) / 1000 << std::setfill(' ');
+}
+
+void formatRecord(std::ostream &os, binaryLog::decodeFormat format, siteInfo const& site, unsigned threadIndex,
+		uint64_t timestamp, std::vector<argValue> const& args) {
+	if (format == binaryLog::decodeFormat::text) {
+		os << "{";
+		writeTimestamp(os, timestamp);
+		os << "} ";
+		if (site.level == LOG_LEVEL_ERROR)
+			os << " !ERROR! ";
+		os << "(t" << threadIndex << ") ";
+		formatMessage(os, site.format, args);
+		os << "\n";
+	} else {
+		std::stringstream msg;
+		formatMessage(msg, site.format, args);
+		os << "{\"timestamp\":" << timestamp << ",\"thread\":" << threadIndex << ",\"level\":" << site.level << ",\"file\":";
+		writeJsonString(os, site.file);
+		os << ",\"line\":" << site.line << ",\"format\":";
+		writeJsonString(os, site.format);
+		os << ",\"message\":";
+		writeJsonString(os, msg.str());
+		os << ",\"args\":[";
+		for (size_t i=0; i<args.size(); i++) {
+			os << (i ? "," : "");
+			writeJsonArg(os, args[i]);
+		}
+		os << "]}\n";
+	}
+}
+
+template<class T>
+void writeRaw(std::ostream &os, T const& value) {
+	os.write((const char*)&value, sizeof(value));
+}
+
+void writeRawString(std::ostream &os, const char* s) {
+	uint32_t len = strlen(s);
+	writeRaw(os, len);
+	os.write(s, len);
+}
+
+template<class T>
+bool readRaw(std::istream &is, T &value) {
+	return (bool)is.read((char*)&value, sizeof(value));
+}
+
+bool readRawString(std::istream &is, std::string &s) {
+	uint32_t len;
+	if (!readRaw(is, len))
+		return false;
+	s.resize(len);
+	return (bool)is.read(&s[0], len);
+}
+
+std::mutex sitesMutex;
+std::vector<siteInfo> sites;	// indexed by site id; guarded by sitesMutex
+
+} // namespace
+
+// the background thread, and the list of all the rings it drains
+class binaryLogWriter {
+public:
+	binaryLogWriter() = default;
+	~binaryLogWriter() {
+		stop();
+	}
+
+	void start(binaryLog::options const& opts) {
+		std::lock_guard<std::mutex> lk(controlMutex_);
+		if (thread_.joinable())
+			return;
+		size_t cap = 1;
+		while (cap < opts.ringBytesPerThread)
+			cap <<= 1;
+		ringCapacity_.store(cap, std::memory_order_relaxed);
+		{
+			std::lock_guard<std::mutex> dlk(drainMutex_);	// flush() may be running
+			opts_ = opts;
+			if (opts_.binaryOut) {
+				opts_.binaryOut->write(fileMagic, sizeof(fileMagic));
+				writeRaw(*opts_.binaryOut, fileVersion);
+				sitesWritten_ = 0;
+			}
+		}
+		stopRequested_ = false;
+		thread_ = std::thread(&binaryLogWriter::run, this);
+		binaryLog::running_.store(true, std::memory_order_release);
+	}
+
+	void stop() {
+		std::lock_guard<std::mutex> lk(controlMutex_);
+		if (!thread_.joinable())
+			return;
+		binaryLog::running_.store(false, std::memory_order_release);
+		{
+			std::lock_guard<std::mutex> wlk(wakeMutex_);
+			stopRequested_ = true;
+		}
+		wakeCond_.notify_one();
+		thread_.join();
+		drain();
+		flushOutputs();
+		// the caller only keeps the stream alive until now; a later flush() has nothing to write anyway
+		std::lock_guard<std::mutex> dlk(drainMutex_);
+		opts_.binaryOut = nullptr;
+		opts_.textOut = false;
+	}
+
+	void flush() {
+		drain();
+		flushOutputs();
+	}
+
+	// only waits for other registrations and for the writer's snapshot of the list, never for a drain
+	binaryLog::threadRing& registerRing() {
+		std::lock_guard<std::mutex> lk(ringsMutex_);
+		rings_.push_back(std::make_shared<binaryLog::threadRing>(ringCapacity_.load(std::memory_order_relaxed), nextRingIndex_++));
+		return *rings_.back();
+	}
+
+	uint64_t getDroppedCount() {
+		return droppedTotal_.load(std::memory_order_relaxed);
+	}
+
+	// marks the ring as abandoned when its thread exits; the writer frees it after draining it
+	struct ringOwner {
+		binaryLog::threadRing* pRing = nullptr;
+		~ringOwner() {
+			if (pRing)
+				pRing->threadExited_.store(true, std::memory_order_release);
+		}
+	};
+
+private:
+	binaryLog::options opts_;
+	std::atomic<size_t> ringCapacity_ { 1 << 20 };
+	std::mutex controlMutex_;	// serializes start() and stop()
+	std::thread thread_;
+	std::mutex wakeMutex_;
+	std::condition_variable wakeCond_;
+	bool stopRequested_ = false;	// guarded by wakeMutex_
+
+	std::atomic<uint64_t> droppedTotal_ { 0 };
+
+	std::mutex ringsMutex_;	// guards the two below; only held for short list updates
+	std::vector<std::shared_ptr<binaryLog::threadRing>> rings_;
+	unsigned nextRingIndex_ = 0;
+
+	std::mutex drainMutex_;	// serializes drains (writer thread, flush(), stop()); guards everything below
+	std::vector<std::shared_ptr<binaryLog::threadRing>> drainRings_;	// snapshot of rings_
+	size_t sitesWritten_ = 0;
+	std::vector<siteInfo> sitesCopy_;	// the sites known to the writer, indexed by id
+
+	struct pendingRecord {
+		uint64_t timestamp;
+		unsigned threadIndex;
+		unsigned siteId;
+		size_t offset;	// of the arguments in the drain buffer
+		size_t argBytes;
+	};
+	std::vector<char> buffer_;
+	std::vector<pendingRecord> pending_;
+
+	void run() {
+		std::unique_lock<std::mutex> lk(wakeMutex_);
+		while (!stopRequested_) {
+			wakeCond_.wait_for(lk, opts_.drainInterval, [this] { return stopRequested_; });
+			lk.unlock();
+			drain();
+			lk.lock();
+		}
+	}
+
+	// Copies everything out of the rings and writes it in timestamp order (across threads; a thread's records are
+	// already in order). Rings of threads that have exited are removed once they're empty.
+	void drain() {
+		std::lock_guard<std::mutex> lk(drainMutex_);
+		{
+			// the rings are drained from a snapshot, so that a thread registering its ring doesn't wait for the drain
+			std::lock_guard<std::mutex> rlk(ringsMutex_);
+			drainRings_.assign(rings_.begin(), rings_.end());
+		}
+		buffer_.clear();
+		pending_.clear();
+		size_t exitedCount = 0;
+		for (auto &pRing : drainRings_) {
+			auto &ring = *pRing;
+			bool exited = ring.threadExited_.load(std::memory_order_acquire);
+			collect(ring);
+			if (uint64_t dropped = ring.dropped_.exchange(0, std::memory_order_relaxed)) {
+				droppedTotal_.fetch_add(dropped, std::memory_order_relaxed);
+				writeDropped(ring.index_, dropped);
+			}
+			if (exited)
+				drainRings_[exitedCount++] = pRing;	// its thread was gone before the collection, the ring is done
+		}
+		if (exitedCount) {
+			std::lock_guard<std::mutex> rlk(ringsMutex_);
+			auto exitedEnd = drainRings_.begin() + exitedCount;
+			rings_.erase(std::remove_if(rings_.begin(), rings_.end(), [&](auto const& pRing) {
+				return std::find(drainRings_.begin(), exitedEnd, pRing) != exitedEnd;
+			}), rings_.end());
+		}
+		drainRings_.clear();
+		if (pending_.empty())
+			return;
+		std::stable_sort(pending_.begin(), pending_.end(), [](pendingRecord const& a, pendingRecord const& b) {
+			return a.timestamp < b.timestamp;
+		});
+		updateSites();
+		for (auto &r : pending_)
+			writeRecord(r);
+	}
+
+	void collect(binaryLog::threadRing &ring) {
+		size_t head = ring.head_.load(std::memory_order_relaxed);
+		size_t tail = ring.tail_.load(std::memory_order_acquire);
+		size_t mask = ring.capacity_ - 1;
+		auto get = [&](size_t pos, void* dst, size_t n) {
+			if (!n)
+				return;
+			size_t offs = pos & mask;
+			size_t first = std::min(n, ring.capacity_ - offs);
+			std::memcpy(dst, ring.data_.get() + offs, first);
+			std::memcpy((char*)dst + first, ring.data_.get(), n - first);
+		};
+		while (head < tail) {
+			binaryLog::recordHeader header;
+			get(head, &header, sizeof(header));
+			size_t argBytes = header.size - sizeof(header);
+			size_t offset = buffer_.size();
+			buffer_.resize(offset + argBytes);
+			get(head + sizeof(header), buffer_.data() + offset, argBytes);
+			pending_.push_back({ header.timestamp, ring.index_, header.siteId, offset, argBytes });
+			head += header.size;
+		}
+		ring.head_.store(head, std::memory_order_release);
+	}
+
+	// copies the sites registered since the last drain, and writes their definitions into the binary output
+	void updateSites() {
+		{
+			std::lock_guard<std::mutex> lk(sitesMutex);
+			sitesCopy_.insert(sitesCopy_.end(), sites.begin() + sitesCopy_.size(), sites.end());
+		}
+		if (!opts_.binaryOut)
+			return;
+		for (; sitesWritten_ < sitesCopy_.size(); sitesWritten_++) {
+			auto &s = sitesCopy_[sitesWritten_];
+			auto &os = *opts_.binaryOut;
+			writeRaw(os, (uint8_t)ENTRY_SITE);
+			writeRaw(os, (uint32_t)sitesWritten_);
+			writeRaw(os, (int32_t)s.level);
+			writeRaw(os, (int32_t)s.line);
+			writeRawString(os, s.file);
+			writeRawString(os, s.format);
+		}
+	}
+
+	void writeRecord(pendingRecord const& r) {
+		if (opts_.binaryOut) {
+			auto &os = *opts_.binaryOut;
+			writeRaw(os, (uint8_t)ENTRY_RECORD);
+			writeRaw(os, (uint32_t)r.siteId);
+			writeRaw(os, (uint32_t)r.threadIndex);
+			writeRaw(os, r.timestamp);
+			writeRaw(os, (uint32_t)r.argBytes);
+			os.write(buffer_.data() + r.offset, r.argBytes);
+		}
+		if (opts_.textOut) {
+			std::vector<argValue> args;
+			parseArgs(buffer_.data() + r.offset, buffer_.data() + r.offset + r.argBytes, args);
+			std::stringstream line;
+			formatRecord(line, binaryLog::decodeFormat::text, sitesCopy_[r.siteId], r.threadIndex, r.timestamp, args);
+			// the level was checked when the record was logged; errors go to the error sinks, like ERRORLOG's
+			if (sitesCopy_[r.siteId].level == LOG_LEVEL_ERROR) {
+				ERRORLOGIMPL(false, line.str());
+			} else {
+				LOGIMPL(LOG_LEVEL_ERROR, false, line.str());
+			}
+		}
+	}
+
+	void writeDropped(unsigned threadIndex, uint64_t count) {
+		if (opts_.binaryOut) {
+			writeRaw(*opts_.binaryOut, (uint8_t)ENTRY_DROPPED);
+			writeRaw(*opts_.binaryOut, (uint32_t)threadIndex);
+			writeRaw(*opts_.binaryOut, count);
+		}
+		if (opts_.textOut)
+			ERRORLOG("binaryLog: " << count << " records dropped on thread t" << threadIndex << " (ring full)");
+	}
+
+	void flushOutputs() {
+		bool textOut;
+		{
+			std::lock_guard<std::mutex> lk(drainMutex_);
+			if (opts_.binaryOut)
+				opts_.binaryOut->flush();
+			textOut = opts_.textOut;
+		}
+		if (textOut)
+			logger::flush();
+	}
+};
+
+namespace {
+binaryLogWriter theWriter;
+thread_local binaryLogWriter::ringOwner crtThreadRing;
+} // namespace
+
+std::atomic<bool> binaryLog::running_ { false };
+
+binaryLog::threadRing::threadRing(size_t capacity, unsigned index)
+	: data_(new char[capacity]), capacity_(capacity), index_(index) {
+}
+
+binaryLog::threadRing& binaryLog::getCrtThreadRing() {
+	if (!crtThreadRing.pRing)
+		crtThreadRing.pRing = &theWriter.registerRing();
+	return *crtThreadRing.pRing;
+}
+
+void binaryLog::start(options const& opts) {
+	theWriter.start(opts);
+}
+
+void binaryLog::stop() {
+	theWriter.stop();
+}
+
+void binaryLog::flush() {
+	theWriter.flush();
+}
+
+uint64_t binaryLog::getDroppedCount() {
+	return theWriter.getDroppedCount();
+}
+
+unsigned binaryLog::registerSite(int level, const char* format, const char* file, int line) {
+	std::lock_guard<std::mutex> lk(sitesMutex);
+	sites.push_back({ level, format, file, line });
+	return sites.size() - 1;
+}
+
+bool binaryLog::decode(std::istream &in, std::ostream &out, decodeFormat format) {
+	char magic[sizeof(fileMagic)];
+	uint32_t version;
+	if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, fileMagic, sizeof(magic)) || !readRaw(in, version) || version != fileVersion)
+		return false;
+	struct decodedSite {
+		int32_t level, line;
+		std::string file, format;
+	};
+	std::vector<decodedSite> decodedSites;
+	std::vector<char> argBytes;
+	std::vector<argValue> args;
+	uint8_t kind;
+	while (readRaw(in, kind)) {
+		switch (kind) {
+		case ENTRY_SITE: {
+			uint32_t id;
+			decodedSite s;
+			if (!readRaw(in, id) || !readRaw(in, s.level) || !readRaw(in, s.line) || !readRawString(in, s.file) || !readRawString(in, s.format))
+				return false;
+			if (id >= decodedSites.size())
+				decodedSites.resize(id + 1);
+			decodedSites[id] = std::move(s);
+			break;
+		}
+		case ENTRY_RECORD: {
+			uint32_t siteId, threadIndex, size;
+			uint64_t timestamp;
+			if (!readRaw(in, siteId) || !readRaw(in, threadIndex) || !readRaw(in, timestamp) || !readRaw(in, size))
+				return false;
+			argBytes.resize(size);
+			if (!in.read(argBytes.data(), size) || siteId >= decodedSites.size())
+				return false;
+			args.clear();
+			if (!parseArgs(argBytes.data(), argBytes.data() + size, args))
+				return false;
+			auto &s = decodedSites[siteId];
+			formatRecord(out, format, siteInfo { s.level, s.format.c_str(), s.file.c_str(), s.line }, threadIndex, timestamp, args);
+			break;
+		}
+		case ENTRY_DROPPED: {
+			uint32_t threadIndex;
+			uint64_t count;
+			if (!readRaw(in, threadIndex) || !readRaw(in, count))
+				return false;
+			if (format == decodeFormat::text)
+				out << "(t" << threadIndex << ") " << count << " records dropped (ring full)\n";
+			else
+				out << "{\"thread\":" << threadIndex << ",\"dropped\":" << count << "}\n";
+			break;
+		}
+		default:
+			return false;
+		}
+	}
+	return in.eof();
+}
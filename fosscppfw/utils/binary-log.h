@@ -0,0 +1,211 @@
+/*
+ * binary-log.h
+ *
+ *  Structured binary logging with deferred formatting.
+ *
+ *		BINLOG("connection {} from {} took {} ms", connId, std::string_view(host), elapsedMs);
+ *
+ *  The logging thread doesn't format anything: it copies the id of the call site (registered once, with its format
+ *  string) and the raw bytes of the arguments into a per-thread ring buffer. A background thread drains the rings
+ *  every few milliseconds and writes the records, in timestamp order, into a binary stream (to be turned back into text
+ *  or JSON with binaryLog::decode(), typically offline), and/or formats them into the regular log (see log.h).
+ *
+ *  Arguments can be integers, bool, char, float / double, const char*, std::string and std::string_view
+ *  (strings are copied into the record). Each "{}" in the format string is replaced by the next argument.
+ *  If a thread's ring is full the record is dropped (and counted), logging never blocks.
+ */
+#pragma once
+
+#include "log.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#define BINLOG_LEVEL(LEVEL, FORMAT, ...) {\
+	if ((LEVEL) <= LOG_MAX_LEVEL && logger::isLevelEnabled(LEVEL) && binaryLog::isRunning()) {\
+		static const unsigned binlogSiteId = binaryLog::registerSite(LEVEL, FORMAT, __FILE__, __LINE__);\
+		binaryLog::write(binlogSiteId, ##__VA_ARGS__);\
+	}\
+}
+
+#define BINLOG(FORMAT, ...) BINLOG_LEVEL(LOG_LEVEL_INFO, FORMAT, ##__VA_ARGS__)
+#if LOG_MAX_LEVEL >= 3
+#define BINDEBUGLOG(FORMAT, ...) BINLOG_LEVEL(LOG_LEVEL_DEBUG, FORMAT, ##__VA_ARGS__)
+#else
+#define BINDEBUGLOG(FORMAT, ...)
+#endif
+#define BINERRORLOG(FORMAT, ...) BINLOG_LEVEL(LOG_LEVEL_ERROR, FORMAT, ##__VA_ARGS__)
+
+class binaryLog {
+public:
+	struct options {
+		std::ostream* binaryOut = nullptr;	// receives the binary records (the caller keeps it alive until stop())
+		bool textOut = false;	// also format the records into the regular log, on the background thread
+		size_t ringBytesPerThread = 1 << 20;	// rounded up to a power of two
+		std::chrono::milliseconds drainInterval { 10 };
+	};
+
+	// starts the background thread; BINLOG calls are ignored while it isn't running
+	static void start(options const& opts);
+	// drains what's left and stops the background thread
+	static void stop();
+	static bool isRunning() { return running_.load(std::memory_order_relaxed); }
+
+	// writes out everything logged so far (from the calling thread) and flushes the outputs
+	static void flush();
+
+	// number of records dropped because a thread's ring was full
+	static uint64_t getDroppedCount();
+
+	enum class decodeFormat {
+		text,	// one line per record, like the regular log
+		json	// one JSON object per line
+	};
+	// Turns a binary log written by this class back into text; returns false if the input isn't a binary log or is
+	// truncated (everything up to that point is still decoded). The binary format uses the byte order of the machine
+	// that wrote it.
+	static bool decode(std::istream &in, std::ostream &out, decodeFormat format = decodeFormat::text);
+
+	// used by the macros above:
+
+	// returns the id of a new call site; the strings must outlive the binaryLog (literals)
+	static unsigned registerSite(int level, const char* format, const char* file, int line);
+
+	template<class... ARGS>
+	static void write(unsigned siteId, ARGS const&... args) {
+		size_t size = sizeof(recordHeader) + (0 + ... + encodedSize(args));
+		threadRing &ring = getCrtThreadRing();
+		size_t pos;
+		if (!ring.reserve(size, pos))
+			return;
+		recordHeader header { (uint32_t)size, siteId, nowNanosec() };
+		pos = ring.put(pos, &header, sizeof(header));
+		(..., (pos = encode(ring, pos, args)));
+		ring.commit(size);
+	}
+
+	// argument type tags in the records
+	enum argType : uint8_t {
+		ARG_INT = 1,	// int64_t
+		ARG_UINT,	// uint64_t
+		ARG_DOUBLE,	// double
+		ARG_STRING,	// uint32_t length + chars
+		ARG_CHAR,	// char
+		ARG_BOOL	// uint8_t
+	};
+
+private:
+	struct recordHeader {
+		uint32_t size;	// of the whole record, header included
+		uint32_t siteId;
+		uint64_t timestamp;	// nanoseconds since the epoch
+	};
+
+	// Single-producer (the owning thread) / single-consumer (the drain) byte ring; records may wrap around the end.
+	struct threadRing {
+		threadRing(size_t capacity, unsigned index);
+
+		// producer side
+		bool reserve(size_t size, size_t &pos) {
+			size_t tail = tail_.load(std::memory_order_relaxed);
+			if (tail + size - cachedHead_ > capacity_) {
+				cachedHead_ = head_.load(std::memory_order_acquire);
+				if (tail + size - cachedHead_ > capacity_) {
+					dropped_.fetch_add(1, std::memory_order_relaxed);	// the drain resets it, so no plain store here
+					return false;
+				}
+			}
+			pos = tail;
+			return true;
+		}
+		size_t put(size_t pos, const void* src, size_t n) {
+			size_t offs = pos & (capacity_ - 1);
+			size_t first = std::min(n, capacity_ - offs);
+			std::memcpy(data_.get() + offs, src, first);
+			std::memcpy(data_.get(), (const char*)src + first, n - first);
+			return pos + n;
+		}
+		void commit(size_t size) {
+			tail_.store(tail_.load(std::memory_order_relaxed) + size, std::memory_order_release);
+		}
+
+		std::unique_ptr<char[]> data_;
+		const size_t capacity_;
+		const unsigned index_;	// in the order the threads first logged
+		std::atomic<bool> threadExited_ { false };
+		std::atomic<uint64_t> dropped_ { 0 };
+		alignas(64) std::atomic<size_t> head_ { 0 };	// written by the drain
+		alignas(64) std::atomic<size_t> tail_ { 0 };	// written by the owning thread
+		size_t cachedHead_ = 0;	// owning thread's copy of head_
+	};
+
+	static std::atomic<bool> running_;
+
+	static threadRing& getCrtThreadRing();
+	static uint64_t nowNanosec() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+
+	// ------- argument encoding -------
+
+	template<class T>
+	static constexpr bool isStringLike = std::is_convertible<T const&, std::string_view>::value;
+
+	template<class T>
+	static size_t encodedSize(T const& value) {
+		if constexpr (isStringLike<T>)
+			return 1 + sizeof(uint32_t) + std::string_view(value).size();
+		else if constexpr (std::is_same<T, bool>::value || std::is_same<T, char>::value)
+			return 1 + 1;
+		else if constexpr (std::is_enum<T>::value)
+			return 1 + sizeof(int64_t);
+		else {
+			static_assert(std::is_arithmetic<T>::value, "BINLOG arguments must be numbers, chars, bools or strings");
+			return 1 + 8;
+		}
+	}
+
+	template<class T>
+	static size_t encode(threadRing &ring, size_t pos, T const& value) {
+		uint8_t tag;
+		if constexpr (isStringLike<T>) {
+			std::string_view s(value);
+			uint32_t len = (uint32_t)s.size();
+			tag = ARG_STRING;
+			pos = ring.put(pos, &tag, 1);
+			pos = ring.put(pos, &len, sizeof(len));
+			return ring.put(pos, s.data(), len);
+		} else if constexpr (std::is_same<T, bool>::value || std::is_same<T, char>::value) {
+			tag = std::is_same<T, bool>::value ? ARG_BOOL : ARG_CHAR;
+			char c = (char)value;
+			pos = ring.put(pos, &tag, 1);
+			return ring.put(pos, &c, 1);
+		} else if constexpr (std::is_floating_point<T>::value) {
+			tag = ARG_DOUBLE;
+			double d = value;
+			pos = ring.put(pos, &tag, 1);
+			return ring.put(pos, &d, sizeof(d));
+		} else if constexpr (std::is_enum<T>::value || std::is_signed<T>::value) {
+			tag = ARG_INT;
+			int64_t i = (int64_t)value;
+			pos = ring.put(pos, &tag, 1);
+			return ring.put(pos, &i, sizeof(i));
+		} else {
+			tag = ARG_UINT;
+			uint64_t u = (uint64_t)value;
+			pos = ring.put(pos, &tag, 1);
+			return ring.put(pos, &u, sizeof(u));
+		}
+	}
+
+	friend class binaryLogWriter;
+};
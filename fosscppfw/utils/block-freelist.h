@@ -0,0 +1,106 @@
+/*
+ * block-freelist.h
+ *
+ *  A thread-safe cache of fixed-size memory blocks, plus a std-compatible allocator on top of it.
+ *  Used to recycle small, frequently created objects (such as PoolTask) without going through malloc every time.
+ */
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <new>
+
+class BlockFreelist {
+public:
+	// blockSize - size of each recycled block; requests larger than this go straight to operator new
+	// maxCachedBlocks - blocks released beyond this count are returned to the system
+	explicit BlockFreelist(size_t blockSize, size_t maxCachedBlocks = 4096)
+		: blockSize_(std::max(blockSize, sizeof(freeBlock)))
+		, maxCachedBlocks_(maxCachedBlocks)
+	{ }
+
+	BlockFreelist(BlockFreelist const&) = delete;
+	BlockFreelist& operator=(BlockFreelist const&) = delete;
+
+	~BlockFreelist() {
+		while (head_) {
+			freeBlock* next = head_->next;
+			::operator delete(head_);
+			head_ = next;
+		}
+	}
+
+	size_t blockSize() const { return blockSize_; }
+
+	void* allocate(size_t size) {
+		if (size > blockSize_)
+			return ::operator new(size);
+		{
+			std::lock_guard<std::mutex> lk(mutex_);
+			if (head_) {
+				freeBlock* b = head_;
+				head_ = b->next;
+				--cachedCount_;
+				return b;
+			}
+		}
+		return ::operator new(blockSize_);
+	}
+
+	void deallocate(void* p, size_t size) {
+		if (size <= blockSize_) {
+			std::lock_guard<std::mutex> lk(mutex_);
+			if (cachedCount_ < maxCachedBlocks_) {
+				head_ = new (p) freeBlock { head_ };
+				++cachedCount_;
+				return;
+			}
+		}
+		::operator delete(p);
+	}
+
+private:
+	struct freeBlock {
+		freeBlock* next;
+	};
+
+	const size_t blockSize_;
+	const size_t maxCachedBlocks_;
+	std::mutex mutex_;
+	freeBlock* head_ = nullptr;
+	size_t cachedCount_ = 0;
+};
+
+// Allocator that serves single-object allocations from a BlockFreelist (use it with std::allocate_shared).
+// Copies of the allocator share ownership of the freelist, so blocks can outlive the object that created the freelist.
+template<class T>
+class FreelistAllocator {
+public:
+	using value_type = T;
+
+	explicit FreelistAllocator(std::shared_ptr<BlockFreelist> freelist)
+		: freelist_(std::move(freelist)) {}
+
+	template<class U>
+	FreelistAllocator(FreelistAllocator<U> const& other)
+		: freelist_(other.freelist_) {}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(freelist_->allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T* p, size_t n) {
+		freelist_->deallocate(p, n * sizeof(T));
+	}
+
+	template<class U>
+	bool operator==(FreelistAllocator<U> const& other) const { return freelist_ == other.freelist_; }
+	template<class U>
+	bool operator!=(FreelistAllocator<U> const& other) const { return freelist_ != other.freelist_; }
+
+private:
+	template<class U> friend class FreelistAllocator;
+	std::shared_ptr<BlockFreelist> freelist_;
+};
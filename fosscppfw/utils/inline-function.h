@@ -0,0 +1,111 @@
+/*
+ * inline-function.h
+ *
+ *  A move-only replacement for std::function<void()> which stores the callable inside a fixed-size buffer
+ *  instead of on the heap. Callables that don't fit into the buffer (or can throw while being moved)
+ *  fall back to a heap allocation; use fitsInline<F>() to enforce the allocation-free path at compile time.
+ */
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template<size_t INLINE_SIZE>
+class InlineFunction {
+public:
+	template<class F>
+	static constexpr bool fitsInline() {
+		return sizeof(F) <= INLINE_SIZE
+			&& alignof(F) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<F>::value;
+	}
+
+	InlineFunction() = default;
+
+	template<class F, class = std::enable_if_t<!std::is_same<std::decay_t<F>, InlineFunction>::value>>
+	InlineFunction(F&& f) {
+		using Fn = std::decay_t<F>;
+		if constexpr (fitsInline<Fn>()) {
+			new (buf_) Fn(std::forward<F>(f));
+			ops_ = &inlineOps<Fn>::table;
+		} else {
+			*reinterpret_cast<Fn**>(buf_) = new Fn(std::forward<F>(f));
+			ops_ = &heapOps<Fn>::table;
+		}
+	}
+
+	InlineFunction(InlineFunction &&src) noexcept {
+		moveFrom(src);
+	}
+
+	InlineFunction& operator=(InlineFunction &&src) noexcept {
+		if (this != &src) {
+			reset();
+			moveFrom(src);
+		}
+		return *this;
+	}
+
+	InlineFunction(InlineFunction const&) = delete;
+	InlineFunction& operator=(InlineFunction const&) = delete;
+
+	~InlineFunction() {
+		reset();
+	}
+
+	void operator()() {
+		ops_->invoke(buf_);
+	}
+
+	explicit operator bool() const {
+		return ops_ != nullptr;
+	}
+
+	void reset() {
+		if (ops_) {
+			ops_->destroy(buf_);
+			ops_ = nullptr;
+		}
+	}
+
+private:
+	struct opsTable {
+		void (*invoke)(void* buf);
+		void (*move)(void* dst, void* src);	// move-constructs dst from src and destroys src
+		void (*destroy)(void* buf);
+	};
+
+	template<class Fn>
+	struct inlineOps {
+		static void invoke(void* buf) { (*static_cast<Fn*>(buf))(); }
+		static void move(void* dst, void* src) {
+			new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+			static_cast<Fn*>(src)->~Fn();
+		}
+		static void destroy(void* buf) { static_cast<Fn*>(buf)->~Fn(); }
+		static constexpr opsTable table { &invoke, &move, &destroy };
+	};
+
+	template<class Fn>
+	struct heapOps {
+		static void invoke(void* buf) { (**static_cast<Fn**>(buf))(); }
+		static void move(void* dst, void* src) { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); }
+		static void destroy(void* buf) { delete *static_cast<Fn**>(buf); }
+		static constexpr opsTable table { &invoke, &move, &destroy };
+	};
+
+	void moveFrom(InlineFunction &src) {
+		if (src.ops_) {
+			src.ops_->move(buf_, src.buf_);
+			ops_ = src.ops_;
+			src.ops_ = nullptr;
+		}
+	}
+
+	static_assert(INLINE_SIZE >= sizeof(void*), "inline buffer must at least hold a pointer");
+
+	const opsTable* ops_ = nullptr;
+	alignas(std::max_align_t) unsigned char buf_[INLINE_SIZE];
+};
@@ -11,6 +11,8 @@
  * The map only locks when writing to it or when a thread refreshes its local view after the map has changed.
  *
  * To use this, declare a shared instance and then use thread_local View instances to access it.
+ * For big maps that change often see RcuMTMap (rcu-mt-map.h), which has the same interface but never copies the map.
+ * When writes are about as frequent as reads, use ShardedHashMap (sharded-hash-map.h) instead.
  */
 template<class K, class V>
 class LocklessMTMap {
@@ -9,75 +9,571 @@
 
 #ifdef _ENABLE_LOGGING_
 
+#include "mpmc-ring-queue.h"
+#include "parking-lot.h"
+
 #include <ctime>
-#include <sstream>
-#include <iomanip>
+#include <cstring>
 #include <iostream>
 #include <deque>
+#include <condition_variable>
+#include <streambuf>
+#include <thread>
 
 LOGGER_THREAD_LOCAL logger theInstance;
 LOGGER_THREAD_LOCAL logger& logger::instance_ { theInstance };
 std::atomic_int logger::logLevel_ { LOG_LEVEL_INFO };
+std::atomic<bool> logger::asyncEnabled_ { false };
+std::atomic_int logger::timestampPrecision_ { (int)logger::timestampPrecision::seconds };
+std::atomic<bool> logger::moduleLevelsUsed_ { false };
+std::atomic<unsigned> logger::moduleLevelsVersion_ { 0 };
+std::atomic<logger::moduleLevelMap const*> logger::moduleLevels_ { nullptr };
+std::mutex logger::moduleLevelsMutex_;
+std::vector<std::unique_ptr<logger::moduleLevelMap>> logger::moduleLevelSnapshots_;
 
 // these two share the same mutex:
 logger_sink logger::stdOutSink_ {&std::cout, std::make_shared<std::mutex>()};
 logger_sink logger::stdErrSink_ {&std::cerr, logger::stdOutSink_.getMutex()};
 std::atomic<logger_sink*> logger::pAddLogSink_ {nullptr};
 std::atomic<logger_sink*> logger::pAddErrSink_ {nullptr};
+std::atomic<unsigned> logger::sinkPhase_ { 0 };
+std::atomic<unsigned> logger::sinkReaders_[2] {};
+
+namespace {
+
+struct asyncRecord {
+	std::string text;	// the formatted message, prefix included
+	bool error;
+};
+
+// streambuf that appends to a string which is then moved into the queued record, so a message is never copied
+class recordBuffer : public std::streambuf {
+public:
+	std::string take() {
+		std::string ret;
+		ret.swap(text_);
+		return ret;
+	}
+
+protected:
+	int_type overflow(int_type c) override {
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+			text_.push_back(traits_type::to_char_type(c));
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(const char* s, std::streamsize n) override {
+		text_.append(s, n);
+		return n;
+	}
+
+private:
+	std::string text_;
+};
+
+// trivially destructible, so it can still be read once crtRecordStream is destroyed
+thread_local bool crtRecordStreamGone = false;
+
+struct threadRecordStream {
+	recordBuffer buffer;
+	std::ostream stream { &buffer };
+	~threadRecordStream() { crtRecordStreamGone = true; }
+};
+
+thread_local threadRecordStream crtRecordStream;
+
+// Used instead of crtRecordStream by the threads whose own is gone (logging from thread_local or static destructors).
+// Never destroyed; the mutex is held from beginAsyncRecord() to commitAsyncRecord().
+threadRecordStream& lateRecordStream() {
+	static threadRecordStream* pStream = new threadRecordStream();
+	return *pStream;
+}
+std::recursive_mutex& lateRecordMutex() {
+	static std::recursive_mutex* pMutex = new std::recursive_mutex();
+	return *pMutex;
+}
+
+// writes a message the way the synchronous macros do (colors only on the terminal)
+void writeRecord(std::ostream &stream, asyncRecord const& r) {
+	if (r.error && &stream == &std::cerr)
+		stream << ioModif::FG_RED;
+	stream << r.text;
+	if (&stream == &std::cout || &stream == &std::cerr)
+		stream << ioModif::RESET;
+}
+
+// writes the log messages of the batch to logSink and the errors to errSink (any may be null), in their original order
+void writeBatchTo(logger_sink* logSink, logger_sink* errSink, asyncRecord const* records, size_t n) {
+	if (!logSink && !errSink)
+		return;
+	std::unique_lock<std::mutex> logLock, errLock;
+	if (logSink)
+		logLock = std::unique_lock<std::mutex>(*logSink->getMutex());
+	if (errSink && (!logSink || errSink->getMutex() != logSink->getMutex()))
+		errLock = std::unique_lock<std::mutex>(*errSink->getMutex());
+	for (size_t i=0; i<n; i++) {
+		logger_sink* sink = records[i].error ? errSink : logSink;
+		if (sink)
+			writeRecord(sink->getStream(), records[i]);
+	}
+}
+
+void flushSink(logger_sink* sink) {
+	if (!sink)
+		return;
+	std::lock_guard<std::mutex> lk(*sink->getMutex());
+	sink->getStream().flush();
+}
+
+void flushAllSinks() {
+	flushSink(logger::getStdOutSink());
+	flushSink(logger::getStdErrSink());
+	logger::sinkReadGuard sinkGuard;
+	flushSink(logger::getAddLogSink());
+	flushSink(logger::getAddErrSink());
+}
+
+// the background writer used in async mode
+class asyncWriter {
+public:
+	// at exit: write out what's left, and let whatever logs later (from other static destructors) do it synchronously
+	~asyncWriter() {
+		logger::setAsync(false);
+	}
+
+	// must be called with controlMutex_ held
+	void start(size_t queueCapacity, std::chrono::milliseconds flushInterval) {
+		if (thread_.joinable())
+			return;
+		if (!queue_)
+			queue_.reset(new MPMCRingQueue<asyncRecord>(queueCapacity));
+		flushInterval_ = flushInterval;
+		stopRequested_.store(false, std::memory_order_relaxed);
+		thread_ = std::thread(&asyncWriter::run, this);
+	}
 
-std::string formatCrtDateTime() {
-	time_t t = time(0);   // get time now
-	struct tm * now = localtime( & t );
-	// output date & time in this format: "yyyy-mm-dd hh:mm:ss"
-	std::stringstream s;
-	s << 1900+now->tm_year << "-";
-	s << std::setw(2) << std::setfill('0') << 1 + now->tm_mon << "-";
-	s << std::setw(2) << std::setfill('0') << now->tm_mday << " ";
-	s << std::setw(2) << std::setfill('0') << now->tm_hour << ":";
-	s << std::setw(2) << std::setfill('0') << now->tm_min << ":";
-	s << std::setw(2) << std::setfill('0') << now->tm_sec;
+	// Must be called with controlMutex_ held, after async mode was turned off; writes everything that was queued
+	// before returning.
+	void stop() {
+		if (!thread_.joinable())
+			return;
+		// Producers that saw async mode still on may be about to push; wait for them while the writer still runs
+		// (one may be blocked on a full queue). Those that come later see it off and write synchronously.
+		while (producers_.load(std::memory_order_seq_cst))
+			std::this_thread::yield();
+		stopRequested_.store(true, std::memory_order_seq_cst);
+		wakeWriter();
+		thread_.join();
+		// nothing should be left by now, but drain the queue anyway rather than lose a message
+		asyncRecord r;
+		while (queue_->try_pop(r))
+			writeBatch(&r, 1);
+		flushAllSinks();
+		markFlushed(enqueued_.load(std::memory_order_acquire));
+	}
+
+	// a producer is between its check of async mode and the push() (or the synchronous write) that follows it
+	void beginProduce() {
+		// seq_cst pairs with the store that turns async mode off and the wait in stop(): either the producer sees
+		// async mode off, or stop() sees the producer
+		producers_.fetch_add(1, std::memory_order_seq_cst);
+	}
+	void endProduce() {
+		producers_.fetch_sub(1, std::memory_order_release);
+	}
+
+	// for messages formatted in async mode that arrive after it was turned off
+	void writeNow(asyncRecord const& r) {
+		writeBatch(&r, 1);
+		flushAllSinks();
+	}
+
+	void push(asyncRecord &&r) {
+		// counted before it's queued: see flush()
+		enqueued_.fetch_add(1, std::memory_order_relaxed);
+		queue_->push(std::move(r));
+		wakeWriter();
+	}
+
+	void flush() {
+		// Every message queued before this call was counted into target before being queued, so once the writer
+		// has written target messages (in queue order), they're all out.
+		uint64_t target = enqueued_.load(std::memory_order_seq_cst);
+		if (flushed_.load(std::memory_order_acquire) >= target)
+			return;
+		uint64_t crt = flushRequest_.load(std::memory_order_relaxed);
+		while (crt < target && !flushRequest_.compare_exchange_weak(crt, target, std::memory_order_relaxed));
+		wakeWriter();
+		parking::waitWhile(flushed_, [target](uint64_t flushed) { return flushed < target; });
+	}
+
+	std::mutex controlMutex_;	// serializes start() and stop()
+
+private:
+	static constexpr size_t maxBatch = 256;
+
+	std::unique_ptr<MPMCRingQueue<asyncRecord>> queue_;
+	std::thread thread_;
+	std::chrono::milliseconds flushInterval_;
+	std::atomic<bool> stopRequested_ { false };
+	std::atomic<uint64_t> enqueued_ { 0 };	// number of messages pushed (or about to be)
+	std::atomic<unsigned> producers_ { 0 };	// see beginProduce()
+	std::atomic<uint64_t> flushRequest_ { 0 };	// flush() is waiting for this many messages to be flushed
+	std::atomic<uint64_t> flushed_ { 0 };	// number of messages written and flushed
+	uint64_t written_ = 0;	// writer thread only
+
+	std::mutex wakeMutex_;
+	std::condition_variable wakeCond_;
+	std::atomic<bool> writerSleeping_ { false };
 
-	return s.str();
+	void wakeWriter() {
+		// pairs with the fence in run(): either the writer sees the new message / request, or we see it's going to sleep
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (writerSleeping_.load(std::memory_order_relaxed)) {
+			std::lock_guard<std::mutex> lk(wakeMutex_);
+			wakeCond_.notify_one();
+		}
+	}
+
+	void markFlushed(uint64_t count) {
+		flushed_.store(count, std::memory_order_release);
+		parking::notifyAll(&flushed_);
+	}
+
+	// returns true if the batch contained errors
+	bool writeBatch(asyncRecord const* records, size_t n) {
+		writeBatchTo(logger::getStdOutSink(), logger::getStdErrSink(), records, n);
+		logger::sinkReadGuard sinkGuard;
+		auto addLog = logger::getAddLogSink();
+		auto addErr = logger::getAddErrSink();
+		if (addLog && addErr && &addLog->getStream() == &addErr->getStream()) {
+			writeBatchTo(addLog, addErr, records, n);
+		} else {
+			writeBatchTo(addLog, nullptr, records, n);
+			writeBatchTo(nullptr, addErr, records, n);
+		}
+		for (size_t i=0; i<n; i++)
+			if (records[i].error)
+				return true;
+		return false;
+	}
+
+	void run() {
+		std::vector<asyncRecord> batch(maxBatch);
+		bool dirty = false;	// written but not flushed yet
+		auto nextFlush = std::chrono::steady_clock::now() + flushInterval_;
+		while (true) {
+			size_t n = queue_->try_pop_n(batch.begin(), maxBatch);
+			bool errors = n && writeBatch(batch.data(), n);
+			written_ += n;
+			dirty = dirty || n;
+			auto now = std::chrono::steady_clock::now();
+			if (dirty && (errors || now >= nextFlush || flushRequest_.load(std::memory_order_relaxed) > flushed_.load(std::memory_order_relaxed))) {
+				flushAllSinks();
+				markFlushed(written_);
+				dirty = false;
+				nextFlush = now + flushInterval_;
+			}
+			if (n == maxBatch || queue_->size_approx())
+				continue;
+			if (stopRequested_.load(std::memory_order_relaxed))
+				break;
+			// nothing to do: sleep until a message arrives, somebody waits in flush(), or it's time to flush
+			auto ready = [&] {
+				return queue_->size_approx() || stopRequested_.load(std::memory_order_relaxed)
+					|| (dirty && flushRequest_.load(std::memory_order_relaxed) > flushed_.load(std::memory_order_relaxed));
+			};
+			std::unique_lock<std::mutex> lk(wakeMutex_);
+			writerSleeping_.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (dirty)
+				wakeCond_.wait_until(lk, nextFlush, ready);
+			else
+				wakeCond_.wait(lk, ready);
+			writerSleeping_.store(false, std::memory_order_relaxed);
+		}
+		if (dirty) {
+			flushAllSinks();
+			markFlushed(written_);
+		}
+	}
+};
+
+asyncWriter theAsyncWriter;
+
+} // namespace
+
+void logger::setAsync(bool enabled, size_t queueCapacity, std::chrono::milliseconds flushInterval) {
+	std::lock_guard<std::mutex> lk(theAsyncWriter.controlMutex_);
+	if (enabled) {
+		theAsyncWriter.start(queueCapacity, flushInterval);
+		asyncEnabled_.store(true, std::memory_order_release);
+	} else {
+		asyncEnabled_.store(false, std::memory_order_seq_cst);
+		theAsyncWriter.stop();
+	}
 }
 
-void logger::push_prefix(std::string prefix) {
+void logger::flush() {
+	if (isAsync())
+		theAsyncWriter.flush();
+	else
+		flushAllSinks();
+}
+
+namespace {
+std::mutex sinkReplaceMutex;	// one replacement at a time, so that the phase flips of two don't interleave
+}
+
+std::ostream* logger::replaceSink(std::atomic<logger_sink*> &sink, std::ostream* newStream,
+		std::shared_ptr<std::mutex> mutex, bool buffered) {
+	logger_sink* newSink = nullptr;
+	if (newStream)
+		newSink = new logger_sink(newStream, mutex ? std::move(mutex) : std::make_shared<std::mutex>(), buffered);
+	std::lock_guard<std::mutex> lk(sinkReplaceMutex);
+	return retireSink(sink.exchange(newSink, std::memory_order_seq_cst));
+}
+
+bool logger::removeSinkIf(std::atomic<logger_sink*> &sink, std::ostream* expected) {
+	std::lock_guard<std::mutex> lk(sinkReplaceMutex);
+	// only replaceSink() and this change the pointer, both under sinkReplaceMutex, so it can't change after the check
+	logger_sink* crtSink = sink.load(std::memory_order_seq_cst);
+	if (!crtSink || crtSink->stream_ != expected)
+		return false;
+	retireSink(sink.exchange(nullptr, std::memory_order_seq_cst));
+	return true;
+}
+
+// waits for the readers that may still use a sink that was just swapped out, then deletes it; called with
+// sinkReplaceMutex locked
+std::ostream* logger::retireSink(logger_sink* oldSink) {
+	if (!oldSink)
+		return nullptr;
+	// a guard that saw the old sink was counted before the exchange, so it's in the counter of one of these two phases
+	for (int i=0; i<2; i++) {
+		unsigned phase = sinkPhase_.fetch_add(1, std::memory_order_seq_cst) & 1;
+		while (sinkReaders_[phase].load(std::memory_order_seq_cst))
+			std::this_thread::yield();
+	}
+	std::ostream* pOld = oldSink->stream_;
+	delete oldSink;
+	return pOld;
+}
+
+std::ostream& logger::beginAsyncRecord() {
+	if (!crtRecordStreamGone)
+		return crtRecordStream.stream;
+	lateRecordMutex().lock();
+	return lateRecordStream().stream;
+}
+
+void logger::commitAsyncRecord(bool error) {
+	asyncRecord r { {}, error };
+	if (crtRecordStreamGone) {
+		r.text = lateRecordStream().buffer.take();
+		lateRecordMutex().unlock();
+	} else
+		r.text = crtRecordStream.buffer.take();
+	theAsyncWriter.beginProduce();
+	// async mode may have been turned off since the macro checked it, and then the writer may be gone
+	if (asyncEnabled_.load(std::memory_order_seq_cst)) {
+		theAsyncWriter.push(std::move(r));
+		theAsyncWriter.endProduce();
+	} else {
+		theAsyncWriter.endProduce();
+		theAsyncWriter.writeNow(r);
+	}
+}
+
+namespace {
+
+// writes value as exactly n decimal digits
+void writeDigits(char* dst, unsigned value, unsigned n) {
+	for (unsigned i=n; i>0; i--, value /= 10)
+		dst[i-1] = '0' + value % 10;
+}
+
+// the wall clock: the coarse one (no more than a few ns to read, but only ticks every few ms) unless microseconds are needed
+void readClock(bool precise, time_t &seconds, long &nanoseconds) {
+#ifdef CLOCK_REALTIME_COARSE
+	struct timespec ts;
+	clock_gettime(precise ? CLOCK_REALTIME : CLOCK_REALTIME_COARSE, &ts);
+	seconds = ts.tv_sec;
+	nanoseconds = ts.tv_nsec;
+#else
+	(void)precise;
+	auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	seconds = ns / 1000000000;
+	nanoseconds = ns % 1000000000;
+#endif
+}
+
+} // namespace
+
+std::string const& logger::prefixStack::getRendered() {
+	if (renderedValid)
+		return rendered;
+	rendered.clear();
+	if (!names.empty()) {
+		rendered += "[";
+		for (unsigned i=0, n=names.size(); i<n; i++) {
+			if (i)
+				rendered += "::";
+			rendered += names[i];
+		}
+		rendered += "] ";
+	}
+	renderedValid = true;
+	return rendered;
+}
+
+int logger::prefixStack::moduleLevelAt(size_t depth) const {
+	return depth ? moduleLevels[depth - 1] : noModuleLevel;
+}
+
+void logger::prefixStack::refreshModuleLevels() {
+	// read the version first: if the overrides change meanwhile, we'll just refresh again next time
+	moduleLevelsVersion = moduleLevelsVersion_.load(std::memory_order_acquire);
+	for (size_t i=0; i<names.size(); i++) {
+		int level = lookupModuleLevel(names[i]);
+		moduleLevels[i] = level != noModuleLevel ? level : moduleLevelAt(i);
+	}
+}
+
+void logger::push_prefix(std::string_view prefix) {
 #if SHARED_LOGGER_INSTANCE
 	std::lock_guard<std::mutex> lock(loggerPrefixMutex_);
-	prefixByTID_[std::this_thread::get_id()].push_back(prefix);
+	auto &stack = prefixByTID_[std::this_thread::get_id()];
 #else
-	prefix_.push_back(prefix);
+	auto &stack = prefix_;
 #endif
+	stack.names.push_back(prefix);
+	stack.renderedValid = false;
+	int level = noModuleLevel;
+	if (moduleLevelsUsed_.load(std::memory_order_relaxed)
+			&& stack.moduleLevelsVersion == moduleLevelsVersion_.load(std::memory_order_acquire))
+		level = lookupModuleLevel(prefix);	// (otherwise the whole stack is refreshed by the next level check)
+	stack.moduleLevels.push_back(level != noModuleLevel ? level : stack.moduleLevelAt(stack.names.size() - 1));
 }
 void logger::pop_prefix() {
 #if SHARED_LOGGER_INSTANCE
 	std::lock_guard<std::mutex> lock(loggerPrefixMutex_);
-	prefixByTID_[std::this_thread::get_id()].pop_back();
+	auto &stack = prefixByTID_[std::this_thread::get_id()];
 #else
-	prefix_.pop_back();
+	auto &stack = prefix_;
 #endif
+	stack.names.pop_back();
+	stack.moduleLevels.pop_back();
+	stack.renderedValid = false;
 }
 
-void logger::writeprefix(std::ostream &stream, bool error) {
-	// 1. write timestamp
-	stream << "{" << formatCrtDateTime() << "} ";
+void logger::setModuleLogLevel(std::string const& module, int level) {
+	std::lock_guard<std::mutex> lock(moduleLevelsMutex_);
+	auto pCrt = moduleLevels_.load(std::memory_order_relaxed);
+	auto pNew = pCrt ? std::make_unique<moduleLevelMap>(*pCrt) : std::make_unique<moduleLevelMap>();
+	pNew->levels[module] = level;
+	pNew->nameLengths |= 1ull << (module.size() % 64);
+	moduleLevels_.store(pNew.get(), std::memory_order_release);
+	moduleLevelSnapshots_.push_back(std::move(pNew));
+	moduleLevelsVersion_.fetch_add(1, std::memory_order_release);
+	moduleLevelsUsed_.store(true, std::memory_order_relaxed);
+}
 
-	if (error) {
-		stream << " !ERROR! ";
+void logger::clearModuleLogLevel(std::string const& module) {
+	std::lock_guard<std::mutex> lock(moduleLevelsMutex_);
+	auto pCrt = moduleLevels_.load(std::memory_order_relaxed);
+	if (!pCrt || !pCrt->levels.count(module))
+		return;
+	auto pNew = std::make_unique<moduleLevelMap>();
+	for (auto &it : pCrt->levels)
+		if (it.first != module) {
+			pNew->levels.insert(it);
+			pNew->nameLengths |= 1ull << (it.first.size() % 64);
+		}
+	moduleLevels_.store(pNew.get(), std::memory_order_release);
+	moduleLevelSnapshots_.push_back(std::move(pNew));
+	moduleLevelsVersion_.fetch_add(1, std::memory_order_release);
+}
+
+int logger::lookupModuleLevel(std::string_view module) {
+	auto pLevels = moduleLevels_.load(std::memory_order_acquire);
+	if (!pLevels || !(pLevels->nameLengths & (1ull << (module.size() % 64))))
+		return noModuleLevel;
+	auto it = pLevels->levels.find(module);
+	return it != pLevels->levels.end() ? it->second : noModuleLevel;
+}
+
+int logger::getEffectiveLevel() {
+#if SHARED_LOGGER_INSTANCE
+	std::lock_guard<std::mutex> lock(loggerPrefixMutex_);
+	auto &stack = prefixByTID_[std::this_thread::get_id()];
+#else
+	auto &stack = prefix_;
+#endif
+	if (stack.moduleLevelsVersion != moduleLevelsVersion_.load(std::memory_order_relaxed))
+		stack.refreshModuleLevels();
+	int level = stack.moduleLevelAt(stack.names.size());
+	return level != noModuleLevel ? level : logLevel_.load(std::memory_order_relaxed);
+}
+
+// writes "{yyyy-mm-dd hh:mm:ss[.fraction]} "
+void logger::writeTimestamp(std::ostream &stream) {
+	auto precision = (timestampPrecision)timestampPrecision_.load(std::memory_order_relaxed);
+	time_t seconds;
+	long nanoseconds;
+	readClock(precision == timestampPrecision::microseconds, seconds, nanoseconds);
+	if (seconds != cachedSecond_) {
+		struct tm now;
+		localtime_r(&seconds, &now);	// not localtime(): async mode calls this outside the sink locks
+		char* p = cachedDateTime_;
+		writeDigits(p, 1900 + now.tm_year, 4);
+		p[4] = '-';
+		writeDigits(p + 5, 1 + now.tm_mon, 2);
+		p[7] = '-';
+		writeDigits(p + 8, now.tm_mday, 2);
+		p[10] = ' ';
+		writeDigits(p + 11, now.tm_hour, 2);
+		p[13] = ':';
+		writeDigits(p + 14, now.tm_min, 2);
+		p[16] = ':';
+		writeDigits(p + 17, now.tm_sec, 2);
+		cachedSecond_ = seconds;
 	}
+	char buf[1 + sizeof(cachedDateTime_) + 7 + 2];
+	size_t len = 0;
+	buf[len++] = '{';
+	std::memcpy(buf + len, cachedDateTime_, sizeof(cachedDateTime_));
+	len += sizeof(cachedDateTime_);
+	if (precision != timestampPrecision::seconds) {
+		buf[len++] = '.';
+		if (precision == timestampPrecision::milliseconds) {
+			writeDigits(buf + len, nanoseconds / 1000000, 3);
+			len += 3;
+		} else {
+			writeDigits(buf + len, nanoseconds / 1000, 6);
+			len += 6;
+		}
+	}
+	buf[len++] = '}';
+	buf[len++] = ' ';
+	stream.write(buf, len);
+}
 
-	// 2. write logger name:
+void logger::writeprefix(std::ostream &stream, bool error) {
 #if SHARED_LOGGER_INSTANCE
 	std::lock_guard<std::mutex> lock(loggerPrefixMutex_);
 	auto &prefix = prefixByTID_[std::this_thread::get_id()];
 #else
 	auto &prefix = prefix_;
 #endif
-	if (prefix.size())
-		stream << "[";
-	for (unsigned i=0, n=prefix.size(); i<n; i++)
-		stream << (i==0 ? "" : "::") << prefix[i];
-	if (prefix.size())
-		stream << "] ";
+	// 1. write timestamp
+	writeTimestamp(stream);
+
+	if (error) {
+		stream << " !ERROR! ";
+	}
+
+	// 2. write logger name:
+	stream << prefix.getRendered();
 }
 
 #endif // _ENABLE_LOGGING_
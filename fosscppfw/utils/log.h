@@ -29,11 +29,25 @@
 #include <mutex>
 #include <atomic>
 #include <memory>
+#include <chrono>
+#include <ctime>
+#include <map>
+#include <string_view>
+#include <unordered_map>
 #if SHARED_LOGGER_INSTANCE
-#	include <unordered_map>
 #	include <thread>
 #endif
 
+/*
+ * Levels more verbose than LOG_MAX_LEVEL are removed at compile time: their macros expand to nothing (DEBUGLOG...) or
+ * to code behind a constant false condition (LOG(X, LEVEL)), so neither the level check nor the stream expression
+ * remains in the binary. 0 = errors only, 1 = info, 2 = verbose, 3 = debug (the default, keeps everything).
+ */
+#ifndef LOG_MAX_LEVEL
+#	define LOG_MAX_LEVEL 3
+#endif
+
+// String literals are referenced, not copied; other strings are kept by the prefix token for its scope.
 #define LOGPREFIX(PREF) logger_prefix logger_prefix_token(PREF);
 
 /** Use EM_ON << "text" << EM_OFF to emphasize some text */
@@ -41,17 +55,27 @@
 #define EM_OFF ioModif::NO_SELECTED
 
 #define LOGIMPL(LEVEL, WRITE_PREFIX, X) {\
-	if (LEVEL <= logger::instance().getLogLevel()) {\
-		for (auto sinkPtr : {logger::getStdOutSink(), logger::getAddLogSink()}) {\
-			if (!sinkPtr)\
-				continue;\
-			std::lock_guard<std::mutex> sinkLock(*sinkPtr->getMutex());\
+	if ((LEVEL) <= LOG_MAX_LEVEL && logger::isLevelEnabled(LEVEL)) {\
+		if (logger::isAsync()) {\
+			std::ostream &recordStream = logger::beginAsyncRecord();\
 			if (WRITE_PREFIX)\
-				logger::instance().writeprefix(sinkPtr->getStream());\
-			sinkPtr->getStream() << X;\
-			if (&sinkPtr->getStream() == &std::cout) \
-				sinkPtr->getStream() << ioModif::RESET; \
-			sinkPtr->getStream().flush();\
+				logger::instance().writeprefix(recordStream);\
+			recordStream << X;\
+			logger::commitAsyncRecord(false);\
+		} else {\
+			logger::sinkReadGuard sinkGuard;\
+			for (auto sinkPtr : {logger::getStdOutSink(), logger::getAddLogSink()}) {\
+				if (!sinkPtr)\
+					continue;\
+				std::lock_guard<std::mutex> sinkLock(*sinkPtr->getMutex());\
+				if (WRITE_PREFIX)\
+					logger::instance().writeprefix(sinkPtr->getStream());\
+				sinkPtr->getStream() << X;\
+				if (&sinkPtr->getStream() == &std::cout) \
+					sinkPtr->getStream() << ioModif::RESET; \
+				if (!sinkPtr->isBuffered())\
+					sinkPtr->getStream().flush();\
+			}\
 		}\
 	}\
 }
@@ -61,20 +85,33 @@
 #define LOGNP(X) LOGIMPL(LOG_LEVEL_INFO, false, X)
 #define LOGLN(X) LOG(X << "\n", LOG_LEVEL_INFO)
 #define LOGRW(X) { LOGNP("\r"); LOG(X, LOG_LEVEL_INFO) }
-#define ERRORLOG(X) {\
-	for (auto sinkPtr : {logger::getStdErrSink(), logger::getAddErrSink()}) {\
-		if (!sinkPtr)\
-			continue;\
-		std::lock_guard<std::mutex> sinkLock(*sinkPtr->getMutex());\
-		if (&sinkPtr->getStream() == &std::cerr) \
-			sinkPtr->getStream() << ioModif::FG_RED;\
-		logger::instance().writeprefix(sinkPtr->getStream(), true);\
-		sinkPtr->getStream() << X << "\n";\
-		if (&sinkPtr->getStream() == &std::cerr) \
-			sinkPtr->getStream() << ioModif::RESET;\
-		sinkPtr->getStream().flush();\
+#define ERRORLOGIMPL(WRITE_PREFIX, X) {\
+	if (logger::isLevelEnabled(LOG_LEVEL_ERROR)) {\
+		if (logger::isAsync()) {\
+			std::ostream &recordStream = logger::beginAsyncRecord();\
+			if (WRITE_PREFIX)\
+				logger::instance().writeprefix(recordStream, true);\
+			recordStream << X;\
+			logger::commitAsyncRecord(true);\
+		} else {\
+			logger::sinkReadGuard sinkGuard;\
+			for (auto sinkPtr : {logger::getStdErrSink(), logger::getAddErrSink()}) {\
+				if (!sinkPtr)\
+					continue;\
+				std::lock_guard<std::mutex> sinkLock(*sinkPtr->getMutex());\
+				if (&sinkPtr->getStream() == &std::cerr) \
+					sinkPtr->getStream() << ioModif::FG_RED;\
+				if (WRITE_PREFIX)\
+					logger::instance().writeprefix(sinkPtr->getStream(), true);\
+				sinkPtr->getStream() << X;\
+				if (&sinkPtr->getStream() == &std::cerr) \
+					sinkPtr->getStream() << ioModif::RESET;\
+				sinkPtr->getStream().flush();	/* even a buffered one: the error may come right before a crash */\
+			}\
+		}\
 	}\
 }
+#define ERRORLOG(X) ERRORLOGIMPL(true, X << "\n")
 
 #else
 #define LOGIMPL(LEVEL, WRITE_PREFIX, X)
@@ -82,16 +119,24 @@
 #define LOGRW(X)
 #define LOGNP(X)
 #define LOGLN(X)
+#define ERRORLOGIMPL(WRITE_PREFIX, X)
 #define ERRORLOG(X)
 #endif
 
+#if LOG_MAX_LEVEL >= 3
 #define DEBUGLOG(X) LOGIMPL(LOG_LEVEL_DEBUG, true, X)
 #define DEBUGLOGNP(X) LOGIMPL(LOG_LEVEL_DEBUG, false, X)
 #define DEBUGLOGLN(X) DEBUGLOG(X << "\n")
+#else
+#define DEBUGLOG(X)
+#define DEBUGLOGNP(X)
+#define DEBUGLOGLN(X)
+#endif
 
 #ifdef _ENABLE_LOGGING_
 
 enum logLevels {
+	LOG_LEVEL_NONE = -1,	// only useful as a level to set: turns off logging, errors included
 	LOG_LEVEL_ERROR = 0,
 	LOG_LEVEL_INFO,
 	LOG_LEVEL_VERBOSE,
@@ -102,79 +147,217 @@ class logger_sink {
 	friend class logger;
 	std::ostream* stream_;
 	std::shared_ptr<std::mutex> mutex_;
+	bool buffered_;	// the stream writes itself out when it sees fit, the macros only flush it after errors
 
 public:
-	logger_sink(std::ostream* stream, std::shared_ptr<std::mutex> mutex)
-		: stream_(stream), mutex_(mutex) {}
+	logger_sink(std::ostream* stream, std::shared_ptr<std::mutex> mutex, bool buffered = false)
+		: stream_(stream), mutex_(mutex), buffered_(buffered) {}
 	std::shared_ptr<std::mutex> getMutex() { return mutex_; }
 	std::ostream& getStream() { return *stream_; }
+	bool isBuffered() const { return buffered_; }
 };
 
 class logger {
 public:
 	void writeprefix(std::ostream &stream, bool error = false);
 
-	// returns old stream
-	static std::ostream* setAdditionalLogStream(std::ostream* newStream) {
-		auto oldLogSink = instance_.pAddLogSink_.load(std::memory_order_acquire);
-		std::ostream* pOld = oldLogSink ? oldLogSink->stream_ : nullptr;
-		instance_.pAddLogSink_.store(new logger_sink(newStream, std::make_shared<std::mutex>()), std::memory_order_release);
-		return pOld;
+	/*
+	 * Sets (or removes, with nullptr) the additional stream that receives the log messages, and returns the old one.
+	 * The old stream isn't used anymore once this returns (it waits for the threads that are writing to it), so it
+	 * can be destroyed right away (and so it must not be called from inside a logging macro's expression).
+	 * A stream that's also written from elsewhere can bring the mutex that guards it; a buffered stream (see
+	 * rotating-file-sink.h) isn't flushed after every log message, only after errors, by flush() and by the async
+	 * writer.
+	 */
+	static std::ostream* setAdditionalLogStream(std::ostream* newStream,
+			std::shared_ptr<std::mutex> mutex = nullptr, bool buffered = false) {
+		return replaceSink(pAddLogSink_, newStream, std::move(mutex), buffered);
+	}
+	// removes the additional log stream if it's still this one (not replaced by someone else meanwhile); true if it was
+	static bool removeAdditionalLogStream(std::ostream* stream) {
+		return removeSinkIf(pAddLogSink_, stream);
 	}
 	static logger_sink* getStdOutSink() {
 		return &stdOutSink_;
 	}
+	// the additional sinks may only be used while holding a sinkReadGuard
 	static logger_sink* getAddLogSink() {
-		return pAddLogSink_.load(std::memory_order_acquire);
+		return pAddLogSink_.load(std::memory_order_seq_cst);
 	}
 
-	// returns old stream
-	static std::ostream* setAdditionalErrStream(std::ostream* newStream) {
-		auto oldErrSink = instance_.pAddErrSink_.load(std::memory_order_acquire);
-		std::ostream* pOld = oldErrSink ? oldErrSink->stream_ : nullptr;
-		instance_.pAddErrSink_.store(new logger_sink(newStream, std::make_shared<std::mutex>()), std::memory_order_release);
-		return pOld;
+	// same as setAdditionalLogStream(), for the error messages
+	static std::ostream* setAdditionalErrStream(std::ostream* newStream,
+			std::shared_ptr<std::mutex> mutex = nullptr, bool buffered = false) {
+		return replaceSink(pAddErrSink_, newStream, std::move(mutex), buffered);
+	}
+	static bool removeAdditionalErrStream(std::ostream* stream) {
+		return removeSinkIf(pAddErrSink_, stream);
 	}
 	static logger_sink* getStdErrSink() {
 		return &stdErrSink_;
 	}
 	static logger_sink* getAddErrSink() {
-		return pAddErrSink_.load(std::memory_order_acquire);
+		return pAddErrSink_.load(std::memory_order_seq_cst);
 	}
 
+	/*
+	 * Held by whoever uses the additional sinks (the logging macros, the async writer); a replaced sink is deleted once
+	 * the guards that may have seen it are gone. The readers are counted in one of two counters, picked by the current
+	 * phase; a replacement flips the phase twice and each time waits for the counter it left to drain (as in RCU), so
+	 * it never waits for the guards taken after it started.
+	 */
+	class sinkReadGuard {
+	public:
+		sinkReadGuard() : phase_(sinkPhase_.load(std::memory_order_seq_cst) & 1) {
+			// seq_cst orders this before the sink pointer loads, against the pointer swap and counter check of replaceSink()
+			sinkReaders_[phase_].fetch_add(1, std::memory_order_seq_cst);
+		}
+		~sinkReadGuard() {
+			sinkReaders_[phase_].fetch_sub(1, std::memory_order_release);
+		}
+		sinkReadGuard(sinkReadGuard const&) = delete;
+		sinkReadGuard& operator=(sinkReadGuard const&) = delete;
+
+	private:
+		unsigned phase_;
+	};
+
 	static logger& instance() { return instance_; }
 
 	static int getLogLevel() { return logLevel_.load(std::memory_order_acquire); }
 	static void setLogLevel(int level) { logLevel_.store(level, std::memory_order_release); }
 
+	/*
+	 * Overrides the log level for a module: while the calling thread is inside a LOGPREFIX(module) scope, its messages
+	 * are filtered by this level instead of the global one (in nested modules the innermost override wins).
+	 * Costs nothing until the first override is set; after that, entering a LOGPREFIX scope looks the name up (without
+	 * locking: the overrides are read from an immutable snapshot).
+	 */
+	static void setModuleLogLevel(std::string const& module, int level);
+	static void clearModuleLogLevel(std::string const& module);
+
+	// true if a message of this level would be logged from the calling thread right now
+	static bool isLevelEnabled(int level) {
+		if (!moduleLevelsUsed_.load(std::memory_order_relaxed))
+			return level <= logLevel_.load(std::memory_order_relaxed);
+		return level <= instance_.getEffectiveLevel();
+	}
+
+	enum class timestampPrecision {
+		seconds,	// {yyyy-mm-dd hh:mm:ss} (the default)
+		milliseconds,	// {yyyy-mm-dd hh:mm:ss.mmm}, from the coarse clock (which ticks every few ms)
+		microseconds	// {yyyy-mm-dd hh:mm:ss.uuuuuu}, from the precise clock
+	};
+	static void setTimestampPrecision(timestampPrecision precision) {
+		timestampPrecision_.store((int)precision, std::memory_order_relaxed);
+	}
+
+	/*
+	 * Turns asynchronous logging on or off for all threads (it's off by default).
+	 * In async mode the logging macros format the message (prefix included) into a thread-local buffer and push it into
+	 * a lock-free queue; a background writer thread takes the messages out in batches and writes them to the sinks,
+	 * flushing the streams at most once every flushInterval (and right away after errors). Logging threads only block
+	 * when the queue is full.
+	 * queueCapacity only applies the first time async mode is turned on.
+	 * Turning it off waits until all the queued messages are written.
+	 */
+	static void setAsync(bool enabled, size_t queueCapacity = 8192,
+			std::chrono::milliseconds flushInterval = std::chrono::milliseconds(100));
+	// acquire: a thread that sees async mode on also sees the writer's queue set up by setAsync()
+	static bool isAsync() { return asyncEnabled_.load(std::memory_order_acquire); }
+
+	// Blocks until everything logged so far by any thread is written out, and flushes the sinks.
+	// Call this before exiting or aborting, when async mode may be on.
+	static void flush();
+
+	// used by the logging macros in async mode
+	static std::ostream& beginAsyncRecord();
+	static void commitAsyncRecord(bool error);
+
 private:
 	static logger_sink stdOutSink_;
 	static logger_sink stdErrSink_;
 	static std::atomic<logger_sink*> pAddLogSink_;
 	static std::atomic<logger_sink*> pAddErrSink_;
+	static std::atomic<unsigned> sinkPhase_;
+	static std::atomic<unsigned> sinkReaders_[2];
+
+	static std::ostream* replaceSink(std::atomic<logger_sink*> &sink, std::ostream* newStream,
+			std::shared_ptr<std::mutex> mutex, bool buffered);
+	static bool removeSinkIf(std::atomic<logger_sink*> &sink, std::ostream* expected);
+	static std::ostream* retireSink(logger_sink* oldSink);
+
+	static constexpr int noModuleLevel = -1000;
+
+	// the LOGPREFIX names of a thread, and their "[a::b::c] " rendering, rebuilt the first time it's needed after a change
+	struct prefixStack {
+		std::vector<std::string_view> names;	// point to literals or into the logger_prefix tokens
+		std::vector<int> moduleLevels;	// the module level override in effect at each depth, or noModuleLevel
+		unsigned moduleLevelsVersion = 0;	// of the overrides moduleLevels was computed from
+		std::string rendered;
+		bool renderedValid = true;
+
+		std::string const& getRendered();
+		int moduleLevelAt(size_t depth) const;
+		void refreshModuleLevels();
+	};
 #if SHARED_LOGGER_INSTANCE
-	std::unordered_map<std::thread::id, std::vector<std::string>> prefixByTID_;
-	std::mutex loggerPrefixMutex_;
+	std::unordered_map<std::thread::id, prefixStack> prefixByTID_;
+	std::mutex loggerPrefixMutex_;	// also guards the timestamp cache below
 #else
-	std::vector<std::string> prefix_;
+	prefixStack prefix_;
 #endif
+	// "yyyy-mm-dd hh:mm:ss" of the last logged second, re-rendered only when the second changes
+	time_t cachedSecond_ = -1;
+	char cachedDateTime_[19];	// not null-terminated
+
 	static LOGGER_THREAD_LOCAL logger& instance_;
 	static std::atomic_int logLevel_;
+	static std::atomic_int timestampPrecision_;
+	static std::atomic<bool> asyncEnabled_;
+
+	static std::atomic<bool> moduleLevelsUsed_;	// false until the first setModuleLogLevel()
+	static std::atomic<unsigned> moduleLevelsVersion_;	// changes whenever an override is set or cleared
+	// The overrides are published as immutable snapshots, so the lookups don't lock. std::less<> lets them look up a
+	// string_view without building a string. Replaced snapshots are kept until exit (overrides are set rarely).
+	struct moduleLevelMap {
+		std::map<std::string, int, std::less<>> levels;
+		uint64_t nameLengths = 0;	// bit (length % 64) is set for each name, most other names are rejected by it
+	};
+	static std::atomic<moduleLevelMap const*> moduleLevels_;
+	static std::mutex moduleLevelsMutex_;	// serializes the writers
+	static std::vector<std::unique_ptr<moduleLevelMap>> moduleLevelSnapshots_;	// guarded by moduleLevelsMutex_
 
-	void push_prefix(std::string prefix);
+	static int lookupModuleLevel(std::string_view module);
+	int getEffectiveLevel();
+
+	void push_prefix(std::string_view prefix);
 	void pop_prefix();
+	void writeTimestamp(std::ostream &stream);
 
 	friend class logger_prefix;
 };
 
 class logger_prefix {
 public:
-	explicit logger_prefix(std::string s) {
-		logger::instance_.push_prefix(s);
+	// character arrays are assumed to be literals, and are referenced rather than copied
+	template<size_t N>
+	explicit logger_prefix(const char (&s)[N]) {
+		logger::instance_.push_prefix(std::string_view(s));
+	}
+	explicit logger_prefix(std::string s)
+		: owned_(std::move(s)) {
+		logger::instance_.push_prefix(owned_);
 	}
 	~logger_prefix() {
 		logger::instance_.pop_prefix();
 	}
+
+	logger_prefix(logger_prefix const&) = delete;
+	logger_prefix& operator=(logger_prefix const&) = delete;
+
+private:
+	std::string owned_;	// the logger keeps a view of this, so the token must not move
 };
 
 #endif // _ENABLE_LOGGING_
@@ -0,0 +1,204 @@
+/*
+ * mpmc-ring-queue.h
+ *
+ *  Bounded lock-free multi-producer / multi-consumer queue, after Dmitry Vyukov's design:
+ *  every cell carries a sequence number that tells producers and consumers whose turn it is,
+ *  so a push or a pop is a single CAS on the corresponding position counter.
+ *  Batch operations claim several consecutive cells with that same single CAS.
+ *
+ *  The blocking variants spin briefly and then park (see parking-lot.h), only when the queue is full / empty.
+ */
+#pragma once
+
+#include "parking-lot.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+template<class T>
+class MPMCRingQueue {
+	static_assert(std::is_nothrow_move_constructible<T>::value, "MPMCRingQueue elements must be nothrow move constructible");
+public:
+	// capacity is rounded up to the next power of two
+	explicit MPMCRingQueue(size_t capacity) {
+		if (capacity == 0)
+			throw std::invalid_argument("MPMCRingQueue capacity must not be zero");
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		mask_ = size - 1;
+		cells_.reset(new cell[size]);
+		for (size_t i=0; i<size; i++)
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	MPMCRingQueue(MPMCRingQueue const&) = delete;
+	MPMCRingQueue& operator=(MPMCRingQueue const&) = delete;
+
+	~MPMCRingQueue() {
+		size_t end = enqueuePos_.load(std::memory_order_relaxed);
+		for (size_t pos = dequeuePos_.load(std::memory_order_relaxed); pos != end; pos++)
+			reinterpret_cast<T*>(cells_[pos & mask_].storage)->~T();
+	}
+
+	size_t capacity() const { return mask_ + 1; }
+
+	// the number of elements in the queue; may not be up to date by the time it's returned
+	size_t size_approx() const {
+		size_t deq = dequeuePos_.load(std::memory_order_relaxed);
+		size_t enq = enqueuePos_.load(std::memory_order_relaxed);
+		return enq > deq ? enq - deq : 0;
+	}
+
+	// returns false (and leaves t untouched) if the queue is full
+	bool try_push(T &&t) {
+		return try_push_n(std::make_move_iterator(&t), 1) == 1;
+	}
+
+	// returns false if the queue is empty
+	bool try_pop(T &out) {
+		return try_pop_n(&out, 1) == 1;
+	}
+
+	// blocks while the queue is full
+	void push(T &&t) {
+		push_n(std::make_move_iterator(&t), 1);
+	}
+
+	// blocks while the queue is empty
+	T pop() {
+		size_t pos;
+		while (!claim(dequeuePos_, 1, 1, pos))
+			waitForTurn(dequeuePos_, 1, waitingConsumers_);
+		T t(takeFrom(pos));
+		wake(waitingProducers_, pos, 1);
+		return t;
+	}
+
+	// Moves up to n elements starting at first into the queue (as many as there is room for) and returns how many.
+	template<class IT>
+	size_t try_push_n(IT first, size_t n) {
+		size_t pos;
+		size_t k = claim(enqueuePos_, 0, n, pos);
+		for (size_t i=0; i<k; i++, ++first) {
+			cell &c = cells_[(pos + i) & mask_];
+			new (c.storage) T(std::move(*first));
+			c.sequence.store(pos + i + 1, std::memory_order_release);
+		}
+		if (k)
+			wake(waitingConsumers_, pos, k);
+		return k;
+	}
+
+	// Pops up to maxCount elements into out and returns how many; doesn't block.
+	template<class OUTIT>
+	size_t try_pop_n(OUTIT out, size_t maxCount) {
+		size_t pos;
+		size_t k = claim(dequeuePos_, 1, maxCount, pos);
+		for (size_t i=0; i<k; i++, ++out)
+			*out = takeFrom(pos + i);
+		if (k)
+			wake(waitingProducers_, pos, k);
+		return k;
+	}
+
+	// Moves all n elements starting at first into the queue, blocking whenever it's full.
+	template<class IT>
+	void push_n(IT first, size_t n) {
+		while (true) {
+			size_t k = try_push_n(first, n);
+			std::advance(first, k);
+			n -= k;
+			if (n == 0)
+				return;
+			waitForTurn(enqueuePos_, 0, waitingProducers_);
+		}
+	}
+
+	// Blocks until at least one element is available, then pops up to maxCount elements and returns how many.
+	template<class OUTIT>
+	size_t pop_n(OUTIT out, size_t maxCount) {
+		if (maxCount == 0)
+			return 0;
+		while (true) {
+			if (size_t k = try_pop_n(out, maxCount))
+				return k;
+			waitForTurn(dequeuePos_, 1, waitingConsumers_);
+		}
+	}
+
+private:
+	struct cell {
+		std::atomic<size_t> sequence;
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	// A cell at position pos is ready for a producer when its sequence is pos, and for a consumer when it is pos + 1.
+	// Claims up to maxCount consecutive ready cells starting at the current position with a single CAS;
+	// returns how many were claimed (0 if the queue is full / empty) and their first position.
+	size_t claim(std::atomic<size_t> &position, size_t seqOffset, size_t maxCount, size_t &pos) {
+		if (maxCount == 0)
+			return 0;
+		pos = position.load(std::memory_order_relaxed);
+		while (true) {
+			size_t seq = cells_[pos & mask_].sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + seqOffset);
+			if (diff == 0) {
+				size_t k = 1;
+				while (k < maxCount && cells_[(pos + k) & mask_].sequence.load(std::memory_order_acquire) == pos + k + seqOffset)
+					k++;
+				if (position.compare_exchange_weak(pos, pos + k, std::memory_order_relaxed))
+					return k;
+			} else if (diff < 0) {
+				return 0;	// the cell still holds the previous lap's element (full) / hasn't been written yet (empty)
+			} else {
+				pos = position.load(std::memory_order_relaxed);	// another thread got this position first
+			}
+		}
+	}
+
+	// moves the element out of a claimed cell and hands the cell over to the producers' next lap
+	T takeFrom(size_t pos) {
+		cell &c = cells_[pos & mask_];
+		T* p = reinterpret_cast<T*>(c.storage);
+		T t(std::move(*p));
+		p->~T();
+		c.sequence.store(pos + mask_ + 1, std::memory_order_release);
+		return t;
+	}
+
+	// parks until the cell at the current position changes, unless it's already ready
+	void waitForTurn(std::atomic<size_t> &position, size_t seqOffset, std::atomic<int> &waiting) {
+		size_t pos = position.load(std::memory_order_relaxed);
+		auto &seq = cells_[pos & mask_].sequence;
+		size_t crt = seq.load(std::memory_order_acquire);
+		if ((intptr_t)crt - (intptr_t)(pos + seqOffset) >= 0)
+			return;
+		// seq_cst pairs with the fence in wake(): either the other side sees us waiting, or we see the updated cell
+		waiting.fetch_add(1, std::memory_order_seq_cst);
+		parking::waitWhileEqual(seq, crt);
+		waiting.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void wake(std::atomic<int> &waiting, size_t pos, size_t k) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed) == 0)
+			return;
+		for (size_t i=0; i<k; i++)
+			parking::notifyAll(&cells_[(pos + i) & mask_].sequence);
+	}
+
+	std::unique_ptr<cell[]> cells_;
+	size_t mask_;
+	alignas(64) std::atomic<size_t> enqueuePos_ { 0 };
+	alignas(64) std::atomic<size_t> dequeuePos_ { 0 };
+	alignas(64) std::atomic<int> waitingProducers_ { 0 };
+	std::atomic<int> waitingConsumers_ { 0 };
+};
@@ -9,42 +9,238 @@
 #define UTILS_PARALLEL_H_
 
 #include "ThreadPool.h"
+#include "parking-lot.h"
 
 #include <iterator>
 #include <algorithm>
 #include <vector>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <type_traits>
 
-static constexpr size_t maxItemsPerJob = 8;
+/*
+ * All the algorithms below use guided self-scheduling: the range is not cut into tasks up front; instead the calling
+ * thread and at most one helper task per pool worker repeatedly grab chunks from a shared cursor. Chunks start large
+ * (remaining / (2 * participants)) and shrink as the range runs out, but never below grainSize, so both huge ranges
+ * of cheap items and a few expensive items balance well, with only a handful of pool tasks per call.
+ *
+ * The calling thread works on the range too and doesn't wait for the helpers to start, so calling these
+ * from inside a pool task is fine: the pool's own workers are never blocked by a full queue when they submit the
+ * helpers (see ThreadPool::submitShared()), so nested calls may take the queue past its maxQueueSize.
+ * grainSize = 0 picks a default of 1.
+ */
+
+namespace parallel_detail {
+
+template<class ITER>
+constexpr bool isRandomAccess = std::is_base_of<std::random_access_iterator_tag,
+	typename std::iterator_traits<ITER>::iterator_category>::value;
+
+// state shared by the calling thread and the helper tasks; outlives the call if a helper starts late
+template<class F>
+struct chunkedWork {
+	chunkedWork(size_t count, size_t grainSize, unsigned participants, F &&fn)
+		: count(count), grainSize(std::max<size_t>(1, grainSize)), participants(participants), fn(std::move(fn)) {
+	}
+
+	const size_t count;
+	const size_t grainSize;
+	const unsigned participants;
+	F fn;	// called as fn(begin, end, slot); each participant gets its own slot in [0, participants)
+	std::atomic<size_t> next { 0 };
+	std::atomic<size_t> done { 0 };
+	std::atomic<unsigned> nextSlot { 0 };
+	std::atomic<bool> failed { false };
+	std::exception_ptr error;	// the first exception thrown by fn, written once by whoever sets failed
+
+	bool grab(size_t &begin, size_t &end) {
+		begin = next.load(std::memory_order_relaxed);
+		do {
+			if (begin >= count)
+				return false;
+			size_t chunk = std::max(grainSize, (count - begin) / (2 * participants));
+			end = std::min(count, begin + chunk);
+		} while (!next.compare_exchange_weak(begin, end, std::memory_order_relaxed));
+		return true;
+	}
+
+	void participate() {
+		size_t begin, end;
+		if (!grab(begin, end))
+			return;	// a late helper, nothing left to do
+		unsigned slot = nextSlot.fetch_add(1, std::memory_order_relaxed);
+		size_t processed = 0;
+		try {
+			do {
+				fn(begin, end, slot);
+				processed += end - begin;
+			} while (grab(begin, end));
+		} catch (...) {
+			// Claim what nobody has grabbed yet and count it as done, along with the chunk that threw, so the caller
+			// stops waiting as soon as the chunks already running finish; it rethrows the first exception then.
+			processed += end - begin;
+			processed += count - next.exchange(count, std::memory_order_relaxed);
+			bool expected = false;
+			if (failed.compare_exchange_strong(expected, true, std::memory_order_relaxed))
+				error = std::current_exception();
+		}
+		// release: whatever this participant wrote into its slot is visible to the thread that sees the final count
+		if (done.fetch_add(processed, std::memory_order_acq_rel) + processed == count)
+			parking::notifyAll(&done);
+	}
+};
+
+// runs fn(begin, end, slot) over [0, count) in chunks and returns when all of them have been processed; if fn throws,
+// the chunks not started yet are skipped and the first exception is rethrown here, once the running ones are done
+template<class F>
+void runChunked(size_t count, ThreadPool &pool, size_t grainSize, F fn) {
+	unsigned participants = pool.getThreadCount() + 1;
+	if (count == 0)
+		return;
+	auto work = std::make_shared<chunkedWork<F>>(count, grainSize, participants, std::move(fn));
+	size_t maxChunks = (count + work->grainSize - 1) / work->grainSize;
+	unsigned helpers = std::min<size_t>(pool.getThreadCount(), maxChunks - 1);
+	for (unsigned i=0; i<helpers; i++)
+		pool.queueDetached([work] { work->participate(); });
+	work->participate();
+	// also when fn threw: the helpers may still be using what fn refers to
+	parking::waitWhile(work->done, [count](size_t done) { return done < count; });
+	if (work->failed.load(std::memory_order_relaxed))
+		std::rethrow_exception(work->error);
+}
+
+// runs fn(first, n, slot) over consecutive sub-ranges [first, first + n) of [itB, itE).
+// Random-access iterators are offset arithmetically; other iterators are walked once to find the boundaries
+// of a fixed number of blocks.
+template<class ITER, class F>
+void forEachRange(ITER itB, ITER itE, ThreadPool &pool, size_t grainSize, F fn) {
+	if constexpr (isRandomAccess<ITER>) {
+		size_t count = itE - itB;
+		runChunked(count, pool, grainSize, [itB, fn](size_t begin, size_t end, unsigned slot) mutable {
+			fn(itB + begin, end - begin, slot);
+		});
+	} else {
+		size_t count = std::distance(itB, itE);
+		size_t blockSize = std::max<size_t>(std::max<size_t>(1, grainSize), count / (4 * (pool.getThreadCount() + 1)));
+		std::vector<std::pair<ITER, size_t>> blocks;
+		for (size_t offs = 0; offs < count; offs += blockSize) {
+			size_t n = std::min(blockSize, count - offs);
+			blocks.emplace_back(itB, n);
+			std::advance(itB, n);
+		}
+		size_t blockCount = blocks.size();
+		runChunked(blockCount, pool, 1, [blocks = std::move(blocks), fn](size_t begin, size_t end, unsigned slot) mutable {
+			for (size_t i=begin; i<end; i++)
+				fn(blocks[i].first, blocks[i].second, slot);
+		});
+	}
+}
+
+// per-participant partial result, padded so that participants don't share cache lines
+template<class T>
+struct alignas(64) partialSlot {
+	std::optional<T> value;
+};
+
+} // namespace parallel_detail
 
+// calls predicate(element) for each element in [itB, itE)
 template<class ITER, class F>
-void parallel_for(ITER itB, ITER itE, ThreadPool &pool, F predicate)
+void parallel_for(ITER itB, ITER itE, ThreadPool &pool, F predicate, size_t grainSize = 0)
+{
+	parallel_detail::forEachRange(itB, itE, pool, grainSize, [predicate](ITER it, size_t n, unsigned) mutable {
+		for (size_t k=0; k<n; k++, ++it)
+			predicate(*it);
+	});
+}
+
+// Reduces [itB, itE) with op, starting from init. Like std::reduce(), op must be associative and commutative,
+// because the order in which partial results are combined is unspecified.
+template<class ITER, class T, class OP>
+T parallel_reduce(ITER itB, ITER itE, ThreadPool &pool, T init, OP op, size_t grainSize = 0)
+{
+	std::vector<parallel_detail::partialSlot<T>> partials(pool.getThreadCount() + 1);
+	auto *pPartials = partials.data();
+	parallel_detail::forEachRange(itB, itE, pool, grainSize, [pPartials, op](ITER it, size_t n, unsigned slot) mutable {
+		auto &partial = pPartials[slot].value;
+		size_t k = 0;
+		if (!partial) {
+			partial.emplace(*it);
+			++it, ++k;
+		}
+		for (; k<n; k++, ++it)
+			*partial = op(std::move(*partial), *it);
+	});
+	for (auto &p : partials)
+		if (p.value)
+			init = op(std::move(init), std::move(*p.value));
+	return init;
+}
+
+// writes f(*it) for each it in [itB, itE) into the range starting at outB (like std::transform())
+template<class ITER, class OUTITER, class F>
+void parallel_transform(ITER itB, ITER itE, OUTITER outB, ThreadPool &pool, F f, size_t grainSize = 0)
 {
-	size_t rangeSize = std::distance(itB, itE);
-	if (rangeSize == 0)
+	static_assert(parallel_detail::isRandomAccess<ITER> && parallel_detail::isRandomAccess<OUTITER>,
+		"parallel_transform requires random access iterators");
+	parallel_detail::runChunked(itE - itB, pool, grainSize, [itB, outB, f](size_t begin, size_t end, unsigned) mutable {
+		auto in = itB + begin;
+		auto out = outB + begin;
+		for (size_t k=begin; k<end; k++, ++in, ++out)
+			*out = f(*in);
+	});
+}
+
+// Inclusive prefix scan of [itB, itE) with op into the range starting at outB (like std::inclusive_scan()).
+// op must be associative. Runs in two parallel passes over a fixed number of blocks: block totals first,
+// then each block is scanned starting from the combined totals of the blocks before it.
+template<class ITER, class OUTITER, class OP>
+void parallel_scan(ITER itB, ITER itE, OUTITER outB, ThreadPool &pool, OP op, size_t grainSize = 0)
+{
+	static_assert(parallel_detail::isRandomAccess<ITER> && parallel_detail::isRandomAccess<OUTITER>,
+		"parallel_scan requires random access iterators");
+	using T = std::decay_t<decltype(op(*itB, *itB))>;
+	size_t count = itE - itB;
+	if (count == 0)
 		return;
-	unsigned minJobs = std::min((size_t)pool.getThreadCount(), rangeSize);
-	unsigned itemsPerJob = std::min(maxItemsPerJob, rangeSize / minJobs);
-	unsigned jobs = rangeSize / itemsPerJob;
-	if (jobs * itemsPerJob < rangeSize)
-		++jobs;
-
-	std::vector<PoolTaskHandle> tasks;
-	decltype(itB) start = itB;
-
-	for (unsigned i=0; i<jobs; ++i) {
-		if (i == jobs-1) {
-			// last job - make sure we don't lose any remaining elements:
-			itemsPerJob = rangeSize - (jobs-1)*itemsPerJob;
+	size_t blockSize = std::max<size_t>(std::max<size_t>(1, grainSize), count / (4 * (pool.getThreadCount() + 1)));
+	size_t blockCount = (count + blockSize - 1) / blockSize;
+	auto blockRange = [count, blockSize](size_t block) {
+		return std::make_pair(block * blockSize, std::min(count, (block + 1) * blockSize));
+	};
+
+	// 1. totals of all blocks but the last, which nobody needs
+	std::vector<std::optional<T>> totals(blockCount);
+	auto *pTotals = totals.data();
+	parallel_detail::runChunked(blockCount - 1, pool, 1, [=](size_t begin, size_t end, unsigned) mutable {
+		for (size_t b=begin; b<end; b++) {
+			auto range = blockRange(b);
+			auto it = itB + range.first;
+			T acc = *it;
+			for (size_t k=range.first+1; k<range.second; k++)
+				acc = op(std::move(acc), *++it);
+			pTotals[b].emplace(std::move(acc));
 		}
-		tasks.push_back(pool.queueTask([start, itemsPerJob, predicate] () mutable {
-			for (unsigned k=0; k<itemsPerJob; k++, ++start)
-				predicate(*start);
-		}));
-		start += itemsPerJob;
-	}
-	// wait for pool tasks to finish:
-	for (auto &t : tasks)
-		t->wait();
+	});
+	// 2. turn them into the prefix carried into each block (sequential, there are only a few)
+	for (size_t b=1; b+1<blockCount; b++)
+		*totals[b] = op(*totals[b-1], std::move(*totals[b]));
+	// 3. scan each block
+	parallel_detail::runChunked(blockCount, pool, 1, [=](size_t begin, size_t end, unsigned) mutable {
+		for (size_t b=begin; b<end; b++) {
+			auto range = blockRange(b);
+			auto in = itB + range.first;
+			auto out = outB + range.first;
+			T acc = b > 0 ? op(*pTotals[b-1], *in) : T(*in);
+			*out = acc;
+			for (size_t k=range.first+1; k<range.second; k++) {
+				acc = op(std::move(acc), *++in);
+				*++out = acc;
+			}
+		}
+	});
 }
 
 
@@ -0,0 +1,19 @@
+#include "parking-lot.h"
+
+#include <cstdint>
+
+namespace parking {
+namespace detail {
+
+static constexpr unsigned bucketCount = 64; // must be a power of two
+
+bucket& bucketFor(const void* address) {
+	static bucket buckets[bucketCount];
+	uintptr_t h = reinterpret_cast<uintptr_t>(address);
+	h ^= h >> 17;
+	h *= 0x9E3779B97F4A7C15ull;
+	return buckets[(h >> 32) & (bucketCount - 1)];
+}
+
+} // namespace detail
+} // namespace parking
@@ -0,0 +1,87 @@
+/*
+ * parking-lot.h
+ *
+ *  Wait / notify on std::atomic variables (what C++20 offers as atomic::wait()/notify_all()).
+ *
+ *  A waiter first spins for a bounded number of iterations (cheap when the wait is short), then parks
+ *  on a condition variable taken from a small global table of buckets keyed by the address of the atomic.
+ *  Notifiers only touch the bucket's mutex when somebody is actually parked there.
+ *
+ *  Usage: the notifier must change the atomic value BEFORE calling notifyAll() on its address.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+namespace parking {
+
+namespace detail {
+	struct bucket {
+		alignas(64) std::mutex mutex;
+		std::condition_variable cond;
+		std::atomic<int> waiters { 0 };
+	};
+	bucket& bucketFor(const void* address);
+} // namespace detail
+
+// hint to the CPU that we're in a spin-wait loop
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+	_mm_pause();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+static constexpr unsigned spinIterations = 128;	// busy iterations before yielding
+static constexpr unsigned yieldIterations = 16;	// yields before parking the thread
+
+// Blocks the calling thread for as long as keepWaiting(value) returns true for the current value of the atomic.
+template<class T, class Pred>
+void waitWhile(std::atomic<T> const& atom, Pred keepWaiting) {
+	for (unsigned i=0; i<spinIterations; i++) {
+		if (!keepWaiting(atom.load(std::memory_order_acquire)))
+			return;
+		cpuRelax();
+	}
+	for (unsigned i=0; i<yieldIterations; i++) {
+		if (!keepWaiting(atom.load(std::memory_order_acquire)))
+			return;
+		std::this_thread::yield();
+	}
+	auto &b = detail::bucketFor(&atom);
+	std::unique_lock<std::mutex> lk(b.mutex);
+	// seq_cst pairs with the fence in notifyAll(): either the notifier sees us waiting, or we see the new value
+	b.waiters.fetch_add(1, std::memory_order_seq_cst);
+	while (keepWaiting(atom.load(std::memory_order_seq_cst)))
+		b.cond.wait(lk);
+	b.waiters.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// Blocks the calling thread for as long as the atomic holds the given value.
+template<class T>
+void waitWhileEqual(std::atomic<T> const& atom, T value) {
+	waitWhile(atom, [value](T crt) { return crt == value; });
+}
+
+// Wakes up all threads waiting on the given atomic. Call this after changing its value.
+inline void notifyAll(const void* address) {
+	auto &b = detail::bucketFor(address);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (b.waiters.load(std::memory_order_relaxed) == 0)
+		return;
+	{
+		// make sure a waiter that has checked the value but isn't blocked on the condition yet doesn't miss the notification
+		std::lock_guard<std::mutex> lk(b.mutex);
+	}
+	b.cond.notify_all();
+}
+
+} // namespace parking
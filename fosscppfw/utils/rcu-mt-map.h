@@ -0,0 +1,316 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * RCU variant of LocklessMTMap, with the same View interface.
+ *
+ * The map is a persistent hash array mapped trie (HAMT): writers never modify a published node, they copy the path
+ * from the root down to the changed entry (O(log32 n) nodes, everything else is shared with the previous version)
+ * and publish the new root with a single atomic store. Writers are serialized by a mutex.
+ *
+ * Readers never lock and never copy: get() just loads the current root and walks it.
+ * The nodes replaced by a write are retired and freed only when every View has moved past the epoch in which they
+ * were retired (epoch-based reclamation). A View stays in the epoch of its last get(), which is what keeps the
+ * pointer returned by get() valid until the next call on the same View - an idle View holds back reclamation,
+ * so destroy the ones you're done with.
+ *
+ * To use this, declare a shared instance and then use thread_local View instances to access it.
+ */
+template<class K, class V, class Hash = std::hash<K>>
+class RcuMTMap {
+	struct node;
+public:
+	class View {
+	public:
+		explicit View(RcuMTMap& source) : pSource_(&source) {
+			pSource_->registerReader(&epoch_);
+		}
+
+		~View() {
+			pSource_->unregisterReader(&epoch_);
+		}
+
+		View(View const&) = delete;
+		View& operator=(View const&) = delete;
+
+		void set(K const& key, V&& value) {
+			std::lock_guard<std::mutex> lock(pSource_->writeMutex_);
+			pSource_->insert(key, std::move(value));
+		}
+
+		/**
+		 * Stores value only when key is missing or value is greater than the currently stored value.
+		 * Returns true when the map was updated. If pOutFinalValue is provided, it receives the value that
+		 * remains stored for key after this call, regardless of whether the map was updated.
+		 */
+		bool setIfGreater(K const& key, V value, V* pOutFinalValue = nullptr) {
+			std::lock_guard<std::mutex> lock(pSource_->writeMutex_);
+			// nobody else can publish while we hold the mutex, so the current root can be read without pinning an epoch
+			V const* pCrt = find(pSource_->root_.load(std::memory_order_relaxed), key, pSource_->hash_(key));
+			if (pCrt && !(value > *pCrt)) {
+				if (pOutFinalValue)
+					*pOutFinalValue = *pCrt;
+				return false;
+			}
+			if (pOutFinalValue)
+				*pOutFinalValue = value;
+			pSource_->insert(key, std::move(value));
+			return true;
+		}
+
+		/**
+		 * Returns the value stored for key, or nullptr if there is none.
+		 * The pointer remains valid until the next call to get() on this View.
+		 */
+		V const* get(K const& key) {
+			// announce the current epoch before loading the root: a writer that retires nodes after this either sees
+			// our announcement and keeps them, or has published its root before we load it, so we never see them.
+			uint64_t epoch = pSource_->globalEpoch_.load(std::memory_order_seq_cst);
+			if (epoch_.load(std::memory_order_relaxed) != epoch)
+				epoch_.store(epoch, std::memory_order_seq_cst);
+			return find(pSource_->root_.load(std::memory_order_seq_cst), key, pSource_->hash_(key));
+		}
+
+	private:
+		RcuMTMap* pSource_;
+		std::atomic<uint64_t> epoch_ { inactiveEpoch };
+	};
+
+	RcuMTMap() = default;
+	RcuMTMap(RcuMTMap const&) = delete;
+	RcuMTMap& operator=(RcuMTMap const&) = delete;
+
+	~RcuMTMap() {
+		destroyTree(root_.load(std::memory_order_relaxed));
+		for (auto &r : retired_)
+			delete r.second;
+	}
+
+	// thread safe-ish (may return non-up-to-date value if another thread is writing to the map)
+	size_t size() const {
+		return size_.load(std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr uint64_t inactiveEpoch = std::numeric_limits<uint64_t>::max();
+	static constexpr unsigned bitsPerLevel = 5;
+	static constexpr size_t levelMask = (1u << bitsPerLevel) - 1;
+
+	enum class nodeKind : uint8_t { branch, leaf, collision };
+
+	struct node {
+		explicit node(nodeKind kind) : kind(kind) {}
+		virtual ~node() = default;
+		const nodeKind kind;
+	};
+
+	// up to 32 children, one for each 5-bit chunk of the hash at this level that is present (as marked in bitmap)
+	struct branch : node {
+		branch() : node(nodeKind::branch) {}
+		uint32_t bitmap = 0;
+		std::vector<node*> children;	// ordered by chunk value
+
+		unsigned indexOf(uint32_t bit) const {
+			return __builtin_popcount(bitmap & (bit - 1));
+		}
+	};
+
+	struct leaf : node {
+		leaf(size_t hash, K const& key, V&& value) : node(nodeKind::leaf), hash(hash), key(key), value(std::move(value)) {}
+		const size_t hash;
+		const K key;
+		V value;
+	};
+
+	// entries whose full hashes are equal
+	struct collision : node {
+		explicit collision(size_t hash) : node(nodeKind::collision), hash(hash) {}
+		const size_t hash;
+		std::vector<std::pair<K, V>> entries;
+	};
+
+	std::atomic<node*> root_ { nullptr };
+	std::atomic<size_t> size_ { 0 };
+	std::atomic<uint64_t> globalEpoch_ { 1 };
+	Hash hash_;
+
+	// everything below is guarded by writeMutex_
+	std::mutex writeMutex_;
+	std::vector<std::atomic<uint64_t>*> readers_;
+	std::vector<std::pair<uint64_t, node*>> retired_;	// nodes removed from the tree, tagged with their retire epoch
+
+	friend class View;
+
+	static size_t chunk(size_t hash, unsigned shift) {
+		return (hash >> shift) & levelMask;
+	}
+
+	static size_t hashOf(node* n) {
+		return n->kind == nodeKind::leaf ? static_cast<leaf*>(n)->hash : static_cast<collision*>(n)->hash;
+	}
+
+	static V const* find(node* n, K const& key, size_t hash) {
+		unsigned shift = 0;
+		while (n) {
+			switch (n->kind) {
+			case nodeKind::branch: {
+				auto b = static_cast<branch*>(n);
+				uint32_t bit = 1u << chunk(hash, shift);
+				if (!(b->bitmap & bit))
+					return nullptr;
+				n = b->children[b->indexOf(bit)];
+				shift += bitsPerLevel;
+				break;
+			}
+			case nodeKind::leaf: {
+				auto l = static_cast<leaf*>(n);
+				return l->hash == hash && l->key == key ? &l->value : nullptr;
+			}
+			case nodeKind::collision: {
+				auto c = static_cast<collision*>(n);
+				if (c->hash != hash)
+					return nullptr;
+				for (auto &e : c->entries)
+					if (e.first == key)
+						return &e.second;
+				return nullptr;
+			}
+			}
+		}
+		return nullptr;
+	}
+
+	// must be called with writeMutex_ held
+	void insert(K const& key, V&& value) {
+		std::vector<node*> replaced;
+		bool added = false;
+		node* oldRoot = root_.load(std::memory_order_relaxed);
+		node* newRoot = insertInto(oldRoot, 0, hash_(key), key, std::move(value), replaced, added);
+		root_.store(newRoot, std::memory_order_seq_cst);
+		if (added)
+			size_.fetch_add(1, std::memory_order_relaxed);
+		uint64_t epoch = globalEpoch_.load(std::memory_order_relaxed);
+		for (node* n : replaced)
+			retired_.emplace_back(epoch, n);
+		globalEpoch_.store(epoch + 1, std::memory_order_seq_cst);
+		reclaim();
+	}
+
+	// returns the new version of n with the entry inserted; nodes of the old version that aren't part of the new one go into replaced
+	node* insertInto(node* n, unsigned shift, size_t hash, K const& key, V&& value, std::vector<node*> &replaced, bool &added) {
+		if (!n) {
+			added = true;
+			return new leaf(hash, key, std::move(value));
+		}
+		switch (n->kind) {
+		case nodeKind::branch: {
+			auto b = static_cast<branch*>(n);
+			uint32_t bit = 1u << chunk(hash, shift);
+			unsigned idx = b->indexOf(bit);
+			auto copy = new branch(*b);
+			if (b->bitmap & bit) {
+				copy->children[idx] = insertInto(b->children[idx], shift + bitsPerLevel, hash, key, std::move(value), replaced, added);
+			} else {
+				copy->bitmap |= bit;
+				copy->children.insert(copy->children.begin() + idx, new leaf(hash, key, std::move(value)));
+				added = true;
+			}
+			replaced.push_back(n);
+			return copy;
+		}
+		case nodeKind::leaf: {
+			auto l = static_cast<leaf*>(n);
+			if (l->hash == hash) {
+				replaced.push_back(n);
+				if (l->key == key)
+					return new leaf(hash, key, std::move(value));
+				auto c = new collision(hash);
+				c->entries.emplace_back(l->key, l->value);
+				c->entries.emplace_back(key, std::move(value));
+				added = true;
+				return c;
+			}
+			added = true;
+			return merge(n, new leaf(hash, key, std::move(value)), shift);	// the old leaf is shared by the new version
+		}
+		case nodeKind::collision: {
+			auto c = static_cast<collision*>(n);
+			if (c->hash == hash) {
+				auto copy = new collision(*c);
+				auto it = std::find_if(copy->entries.begin(), copy->entries.end(), [&key](auto const& e) { return e.first == key; });
+				if (it != copy->entries.end()) {
+					it->second = std::move(value);
+				} else {
+					copy->entries.emplace_back(key, std::move(value));
+					added = true;
+				}
+				replaced.push_back(n);
+				return copy;
+			}
+			added = true;
+			return merge(n, new leaf(hash, key, std::move(value)), shift);
+		}
+		}
+		return nullptr;
+	}
+
+	// builds the branches needed to hold two nodes with different hashes, starting at the given level
+	static node* merge(node* a, node* b, unsigned shift) {
+		auto br = new branch();
+		size_t ca = chunk(hashOf(a), shift);
+		size_t cb = chunk(hashOf(b), shift);
+		if (ca == cb) {
+			br->bitmap = 1u << ca;
+			br->children.push_back(merge(a, b, shift + bitsPerLevel));
+		} else {
+			br->bitmap = (1u << ca) | (1u << cb);
+			if (ca < cb)
+				br->children = { a, b };
+			else
+				br->children = { b, a };
+		}
+		return br;
+	}
+
+	// frees the retired nodes that no View can still be looking at; must be called with writeMutex_ held
+	void reclaim() {
+		uint64_t minEpoch = inactiveEpoch;
+		for (auto r : readers_)
+			minEpoch = std::min(minEpoch, r->load(std::memory_order_seq_cst));
+		auto it = retired_.begin();
+		while (it != retired_.end() && it->first < minEpoch) {
+			delete it->second;	// only the node itself, its children belong to newer versions
+			++it;
+		}
+		retired_.erase(retired_.begin(), it);
+	}
+
+	static void destroyTree(node* n) {
+		if (!n)
+			return;
+		if (n->kind == nodeKind::branch)
+			for (node* c : static_cast<branch*>(n)->children)
+				destroyTree(c);
+		delete n;
+	}
+
+	void registerReader(std::atomic<uint64_t>* pEpoch) {
+		std::lock_guard<std::mutex> lock(writeMutex_);
+		readers_.push_back(pEpoch);
+	}
+
+	void unregisterReader(std::atomic<uint64_t>* pEpoch) {
+		std::lock_guard<std::mutex> lock(writeMutex_);
+		readers_.erase(std::remove(readers_.begin(), readers_.end(), pEpoch), readers_.end());
+		reclaim();
+	}
+};
@@ -0,0 +1,356 @@
+/*
+ * rotating-file-sink.cpp
+ *
+ *  Locking: mutex_ (shared with the logger) guards the buffer and the file; bgMutex_ guards the hand-over of rotated
+ *  files to the background thread, which compresses and deletes them without holding mutex_.
+ */
+
+#include "rotating-file-sink.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZLIB
+#	include <zlib.h>
+#endif
+
+#ifndef IOV_MAX
+#	define IOV_MAX 1024
+#endif
+
+namespace {
+
+// writes all of iov[0..n), retrying on partial writes and interrupts; returns false on error
+bool writeAll(int fd, struct iovec* iov, size_t n) {
+	while (n) {
+		ssize_t written = writev(fd, iov, (int)std::min<size_t>(n, IOV_MAX));
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		while (n && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base = (char*)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+const char* lastNewline(const char* begin, const char* end) {
+	while (end != begin)
+		if (*--end == '\n')
+			return end;
+	return nullptr;
+}
+
+#ifdef HAVE_ZLIB
+// gzips src into src.gz (through a temporary, so a partial .gz is never left behind) and deletes src
+bool compressFile(std::string const& src) {
+	int in = ::open(src.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0)
+		return false;
+	std::string tmp = src + ".gz.tmp";
+	gzFile out = gzopen(tmp.c_str(), "wb6");
+	if (!out) {
+		::close(in);
+		return false;
+	}
+	std::unique_ptr<char[]> buf(new char[256 << 10]);
+	bool ok = true;
+	ssize_t n;
+	while (ok && (n = ::read(in, buf.get(), 256 << 10)) != 0) {
+		if (n < 0)
+			ok = errno == EINTR;
+		else
+			ok = gzwrite(out, buf.get(), (unsigned)n) == n;
+	}
+	::close(in);
+	ok = gzclose(out) == Z_OK && ok;
+	if (ok && std::rename(tmp.c_str(), (src + ".gz").c_str()) == 0) {
+		::unlink(src.c_str());
+		return true;
+	}
+	::unlink(tmp.c_str());
+	return false;
+}
+#endif
+
+} // namespace
+
+rotatingFileSink::fileBuffer::fileBuffer(rotatingFileSink &owner)
+	: owner_(owner), crt_(new char[chunkSize]) {
+	setp(crt_.get(), crt_.get() + chunkSize);
+}
+
+rotatingFileSink::fileBuffer::int_type rotatingFileSink::fileBuffer::overflow(int_type c) {
+	full_.push_back(std::move(crt_));
+	if (spare_.empty()) {
+		crt_.reset(new char[chunkSize]);
+	} else {
+		crt_ = std::move(spare_.back());
+		spare_.pop_back();
+	}
+	setp(crt_.get(), crt_.get() + chunkSize);
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+	// may be in the middle of a message, so a rotation can only happen at the end of the last complete one
+	if (owner_.opts_.maxFileSize && owner_.fd_ >= 0 && owner_.fileSize_ + pendingBytes() >= owner_.opts_.maxFileSize)
+		rotateAtLineEnd();
+	else if (pendingBytes() >= owner_.opts_.batchBytes)
+		writeOut();
+	return traits_type::not_eof(c);
+}
+
+// writes out up to the last complete line, rotates, and keeps the rest (the start of the message being written)
+void rotatingFileSink::fileBuffer::rotateAtLineEnd() {
+	std::string rest;
+	if (const char* nl = lastNewline(pbase(), pptr())) {
+		rest.assign(nl + 1, pptr() - (nl + 1));
+		setp(crt_.get(), crt_.get() + chunkSize);
+		pbump(nl + 1 - crt_.get());
+	} else {
+		size_t i = full_.size();
+		const char* nlFull = nullptr;
+		while (i > 0 && !(nlFull = lastNewline(full_[i-1].get(), full_[i-1].get() + chunkSize)))
+			i--;
+		if (!nlFull) {
+			writeOut();	// one huge message, it can't be split
+			return;
+		}
+		// the line ends in chunk i-1: what follows it becomes the rest, and that chunk becomes the put area
+		rest.assign(nlFull + 1, full_[i-1].get() + chunkSize - (nlFull + 1));
+		for (size_t j=i; j<full_.size(); j++)
+			rest.append(full_[j].get(), chunkSize);
+		rest.append(pbase(), pptr() - pbase());
+		spare_.push_back(std::move(crt_));
+		crt_ = std::move(full_[i-1]);
+		for (size_t j=i; j<full_.size(); j++)
+			spare_.push_back(std::move(full_[j]));
+		full_.resize(i-1);
+		setp(crt_.get(), crt_.get() + chunkSize);
+		pbump(nlFull + 1 - crt_.get());
+	}
+	writeOut();
+	owner_.rotateLocked();
+	sputn(rest.data(), rest.size());
+}
+
+int rotatingFileSink::fileBuffer::sync() {
+	writeOut();
+	if (owner_.rotationDue())
+		owner_.rotateLocked();
+	// errors are counted, not reported: a failed stream would swallow all the messages that follow
+	return 0;
+}
+
+void rotatingFileSink::fileBuffer::writeOut() {
+	size_t pending = pendingBytes();
+	if (!pending)
+		return;
+	if (owner_.fd_ < 0)
+		owner_.openFile();	// retry after a failed rotation
+	std::vector<struct iovec> iov;
+	iov.reserve(full_.size() + 1);
+	for (auto &chunk : full_)
+		iov.push_back({ chunk.get(), chunkSize });
+	if (pptr() != pbase())
+		iov.push_back({ pbase(), size_t(pptr() - pbase()) });
+	if (owner_.fd_ >= 0 && writeAll(owner_.fd_, iov.data(), iov.size()))
+		owner_.fileSize_ += pending;
+	else
+		owner_.droppedBytes_ += pending;
+	for (auto &chunk : full_)
+		spare_.push_back(std::move(chunk));
+	full_.clear();
+	setp(crt_.get(), crt_.get() + chunkSize);
+}
+
+rotatingFileSink::rotatingFileSink(options const& opts)
+	: opts_(opts), buffer_(*this), stream_(&buffer_) {
+#ifndef HAVE_ZLIB
+	if (opts_.compress)
+		throw std::runtime_error("rotatingFileSink: compression needs zlib (build with HAVE_ZLIB)");
+#endif
+	auto dir = std::filesystem::path(opts_.path).parent_path();
+	std::error_code err;
+	if (!dir.empty())
+		std::filesystem::create_directories(dir, err);
+	if (!openFile())
+		throw std::runtime_error("rotatingFileSink: unable to open " + opts_.path + ": " + std::strerror(errno));
+	thread_ = std::thread(&rotatingFileSink::run, this);
+}
+
+rotatingFileSink::~rotatingFileSink() {
+	if (attachedLog_ || attachedErr_)
+		logger::flush();	// what the async writer still has queued for us
+	// (unless another sink has replaced us since)
+	if (attachedLog_)
+		logger::removeAdditionalLogStream(&stream_);
+	if (attachedErr_)
+		logger::removeAdditionalErrStream(&stream_);
+	{
+		std::lock_guard<std::mutex> lk(bgMutex_);
+		stopRequested_ = true;
+	}
+	bgCond_.notify_one();
+	thread_.join();
+	std::lock_guard<std::mutex> lk(*mutex_);
+	buffer_.writeOut();
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+void rotatingFileSink::attachToLogger(bool logMessages, bool errorMessages) {
+	if (logMessages) {
+		logger::setAdditionalLogStream(&stream_, mutex_, true);
+		attachedLog_ = true;
+	}
+	if (errorMessages) {
+		logger::setAdditionalErrStream(&stream_, mutex_, true);
+		attachedErr_ = true;
+	}
+}
+
+void rotatingFileSink::flush() {
+	std::lock_guard<std::mutex> lk(*mutex_);
+	buffer_.writeOut();
+}
+
+void rotatingFileSink::rotate() {
+	std::lock_guard<std::mutex> lk(*mutex_);
+	buffer_.writeOut();
+	rotateLocked();
+}
+
+uint64_t rotatingFileSink::getDroppedBytes() const {
+	std::lock_guard<std::mutex> lk(*mutex_);
+	return droppedBytes_;
+}
+
+bool rotatingFileSink::openFile() {
+	fd_ = ::open(opts_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		return false;
+	struct stat st;
+	fileSize_ = fstat(fd_, &st) == 0 ? st.st_size : 0;
+	openedAt_ = std::chrono::steady_clock::now();
+	return true;
+}
+
+bool rotatingFileSink::rotationDue() const {
+	if (fd_ < 0 || !fileSize_)
+		return false;
+	if (opts_.maxFileSize && fileSize_ >= opts_.maxFileSize)
+		return true;
+	return opts_.maxFileAge.count() && std::chrono::steady_clock::now() - openedAt_ >= opts_.maxFileAge;
+}
+
+// must be called with mutex_ held, after writeOut()
+void rotatingFileSink::rotateLocked() {
+	if (fd_ >= 0) {
+		::close(fd_);
+		fd_ = -1;
+	}
+	std::string rotatedName = makeRotatedName();
+	bool renamed = std::rename(opts_.path.c_str(), rotatedName.c_str()) == 0;
+	openFile();	// if this fails the next writeOut() tries again
+	if (!renamed)
+		return;
+	{
+		std::lock_guard<std::mutex> lk(bgMutex_);
+		rotatedFiles_.push_back(std::move(rotatedName));
+	}
+	bgCond_.notify_one();
+}
+
+// path.yyyymmdd-hhmmss.mmm in local time, which sorts in rotation order; if that's taken, a _NNN suffix is added
+// (it sorts after the name without it, and after a .gz)
+std::string rotatingFileSink::makeRotatedName() {
+	auto now = std::chrono::system_clock::now();
+	time_t seconds = std::chrono::system_clock::to_time_t(now);
+	unsigned millis = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count() % 1000;
+	struct tm tmNow;
+	localtime_r(&seconds, &tmNow);
+	char stamp[32];
+	size_t len = strftime(stamp, sizeof(stamp), ".%Y%m%d-%H%M%S", &tmNow);
+	snprintf(stamp + len, sizeof(stamp) - len, ".%03u", millis);
+	std::string name = opts_.path + stamp;
+	std::string candidate = name;
+	std::error_code err;
+	for (unsigned i=1; std::filesystem::exists(candidate, err) || std::filesystem::exists(candidate + ".gz", err); i++) {
+		char suffix[16];
+		snprintf(suffix, sizeof(suffix), "_%03u", i);
+		candidate = name + suffix;
+	}
+	return candidate;
+}
+
+void rotatingFileSink::run() {
+	deleteOldFiles();	// left over from previous runs
+	std::unique_lock<std::mutex> bgLock(bgMutex_);
+	while (true) {
+		bgCond_.wait_for(bgLock, opts_.flushInterval, [this] { return stopRequested_ || !rotatedFiles_.empty(); });
+		bool stop = stopRequested_;
+		std::vector<std::string> rotated;
+		rotated.swap(rotatedFiles_);
+		bgLock.unlock();
+		if (!stop) {
+			// the messages are written with mutex_ held, so this comes between two of them (and may rotate by age)
+			std::lock_guard<std::mutex> lk(*mutex_);
+			stream_.flush();
+		}
+#ifdef HAVE_ZLIB
+		if (opts_.compress)
+			for (auto &file : rotated)
+				compressFile(file);
+#endif
+		if (!rotated.empty())
+			deleteOldFiles();
+		bgLock.lock();
+		if (stop && rotatedFiles_.empty())
+			break;
+	}
+}
+
+void rotatingFileSink::deleteOldFiles() {
+	if (!opts_.maxRotatedFiles)
+		return;
+	std::filesystem::path path(opts_.path);
+	std::filesystem::path dir = path.parent_path().empty() ? std::filesystem::path(".") : path.parent_path();
+	std::string prefix = path.filename().string() + ".";
+	std::vector<std::string> names;
+	std::error_code err;
+	for (auto it = std::filesystem::directory_iterator(dir, err); !err && it != std::filesystem::directory_iterator(); it.increment(err)) {
+		std::string name = it->path().filename().string();
+		// path.<digits>..., but not the temporaries of a compression in progress
+		if (name.size() > prefix.size() && name.compare(0, prefix.size(), prefix) == 0 && isdigit((unsigned char)name[prefix.size()])
+				&& (name.size() < 4 || name.compare(name.size() - 4, 4, ".tmp") != 0))
+			names.push_back(name);
+	}
+	if (names.size() <= opts_.maxRotatedFiles)
+		return;
+	std::sort(names.begin(), names.end());
+	for (size_t i=0; i<names.size() - opts_.maxRotatedFiles; i++)
+		std::filesystem::remove(dir / names[i], err);
+}
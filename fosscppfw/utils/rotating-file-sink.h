@@ -0,0 +1,118 @@
+/*
+ * rotating-file-sink.h
+ *
+ *  A log file that rotates by size and/or age and keeps a bounded number of old files.
+ *
+ *		rotatingFileSink::options opts;
+ *		opts.path = "logs/server.log";
+ *		rotatingFileSink fileSink(opts);
+ *		fileSink.attachToLogger();	// log and error messages now also go to the file
+ *
+ *  Messages are collected in memory and written out in large batches (a single writev() of all the buffered chunks),
+ *  when batchBytes are buffered, every flushInterval (on a background thread), after each error message and by
+ *  logger::flush(), instead of a write per message.
+ *  A rotation renames the current file to path.yyyymmdd-hhmmss.mmm and starts a new one. It always happens at the end
+ *  of a line, so no line is split across files: a file grows past maxFileSize by less than a buffer chunk (64KB),
+ *  unless a single message is larger than that, and past maxFileAge by less than a flushInterval.
+ *  The background thread gzips the rotated files (when built with HAVE_ZLIB) and deletes the oldest ones beyond
+ *  maxRotatedFiles.
+ */
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+class rotatingFileSink {
+public:
+	struct options {
+		std::string path;	// the file being written; its directory is created if missing
+		uint64_t maxFileSize = 64 << 20;	// rotate once the file is this large (0 = no size limit)
+		std::chrono::seconds maxFileAge { 0 };	// rotate once the file has been written for this long (0 = no limit)
+		unsigned maxRotatedFiles = 8;	// rotated files to keep, older ones are deleted (0 = keep them all)
+		size_t batchBytes = 1 << 20;	// write out as soon as this much is buffered
+		std::chrono::milliseconds flushInterval { 100 };	// and at least this often
+		bool compress = false;	// gzip the rotated files, needs HAVE_ZLIB
+	};
+
+	// opens (appends to) the file; throws std::runtime_error if it can't, or if compression is asked for without zlib
+	explicit rotatingFileSink(options const& opts);
+	// detaches from the logger (unless another stream has replaced it there), writes out what's buffered and waits for
+	// the pending compressions
+	~rotatingFileSink();
+
+	rotatingFileSink(rotatingFileSink const&) = delete;
+	rotatingFileSink& operator=(rotatingFileSink const&) = delete;
+
+	// Makes this file the logger's additional log and/or error stream (replacing the current ones).
+	// The same file can serve both, the messages stay in order.
+	void attachToLogger(bool logMessages = true, bool errorMessages = true);
+
+	// for writing to the file directly: lock getMutex() around it, it's the one the logger and the background thread use
+	std::ostream& getStream() { return stream_; }
+	std::shared_ptr<std::mutex> getMutex() const { return mutex_; }
+
+	// writes out everything buffered so far
+	void flush();
+	// rotates now (after writing out what's buffered)
+	void rotate();
+
+	// bytes lost to write errors (a full disk, say); the logger keeps going without them
+	uint64_t getDroppedBytes() const;
+
+private:
+	// collects the output in fixed-size chunks, all written at once by writeOut(); used with mutex_ locked
+	class fileBuffer : public std::streambuf {
+	public:
+		explicit fileBuffer(rotatingFileSink &owner);
+		size_t pendingBytes() const { return full_.size() * chunkSize + (pptr() - pbase()); }
+		void writeOut();
+		void rotateAtLineEnd();
+
+	protected:
+		int_type overflow(int_type c) override;
+		int sync() override;	// writes out, and rotates if it's due: ostream::flush() only comes between messages
+
+	private:
+		static constexpr size_t chunkSize = 64 << 10;
+
+		rotatingFileSink &owner_;
+		std::unique_ptr<char[]> crt_;	// the put area
+		std::vector<std::unique_ptr<char[]>> full_;
+		std::vector<std::unique_ptr<char[]>> spare_;	// written chunks, for reuse
+	};
+
+	const options opts_;
+	std::shared_ptr<std::mutex> mutex_ { std::make_shared<std::mutex>() };
+	fileBuffer buffer_;
+	std::ostream stream_;
+	bool attachedLog_ = false;
+	bool attachedErr_ = false;
+
+	// guarded by mutex_
+	int fd_ = -1;
+	uint64_t fileSize_ = 0;
+	std::chrono::steady_clock::time_point openedAt_;
+	uint64_t droppedBytes_ = 0;
+
+	// background thread; the members below are guarded by bgMutex_
+	std::thread thread_;
+	std::mutex bgMutex_;
+	std::condition_variable bgCond_;
+	std::vector<std::string> rotatedFiles_;	// waiting to be compressed
+	bool stopRequested_ = false;
+
+	bool openFile();
+	void rotateLocked();
+	bool rotationDue() const;
+	std::string makeRotatedName();
+	void run();
+	void deleteOldFiles();
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+
+/**
+ * Concurrent hash map for write-heavy workloads (where LocklessMTMap, which serializes all writes and copies the
+ * map on reads, doesn't fit).
+ *
+ * Keys are spread over a configurable number of shards by the high bits of their hash; each shard has its own lock
+ * and a flat open-addressing table (linear probing, a one-byte control array with a 7-bit hash tag per slot, entries
+ * stored inline). Operations on keys in different shards never contend.
+ *
+ * All operations are thread-safe. upsert(), compute() and setIfGreater() are atomic with respect to other operations
+ * on the same key. Values are returned by copy, since an entry may move when its shard grows.
+ */
+template<class K, class V, class Hash = std::hash<K>>
+class ShardedHashMap {
+public:
+	// shardCount is rounded up to the next power of two; initialCapacity is the expected total number of entries
+	explicit ShardedHashMap(size_t shardCount = 64, size_t initialCapacity = 0) {
+		shardBits_ = 0;
+		while ((size_t(1) << shardBits_) < shardCount)
+			shardBits_++;
+		shards_.reset(new shard[size_t(1) << shardBits_]);
+		size_t perShard = initialCapacity >> shardBits_;
+		for (size_t i=0; i<shardCountPow2(); i++)
+			shards_[i].table.reserve(perShard);
+	}
+
+	ShardedHashMap(ShardedHashMap const&) = delete;
+	ShardedHashMap& operator=(ShardedHashMap const&) = delete;
+
+	size_t shardCount() const { return shardCountPow2(); }
+
+	// inserts or overwrites the value for key; returns true if the key was new
+	bool upsert(K const& key, V value) {
+		size_t h = hashOf(key);
+		auto &s = shardFor(h);
+		std::lock_guard<std::mutex> lk(s.mutex);
+		bool inserted;
+		V* p = s.table.findOrInsert(key, h, inserted, [&] { return std::move(value); });
+		if (!inserted)
+			*p = std::move(value);
+		return inserted;
+	}
+
+	/**
+	 * Atomically replaces the value for key with f(pCurrent), where pCurrent points to the current value, or is nullptr
+	 * if the key is missing. Returns the value stored after the call. f runs with the shard locked - keep it short and
+	 * don't access the map from it.
+	 */
+	template<class F>
+	V compute(K const& key, F f) {
+		size_t h = hashOf(key);
+		auto &s = shardFor(h);
+		std::lock_guard<std::mutex> lk(s.mutex);
+		V* p = s.table.find(key, h);
+		if (p) {
+			*p = f(static_cast<V const*>(p));
+		} else {
+			bool inserted;
+			p = s.table.findOrInsert(key, h, inserted, [&] { return f(static_cast<V const*>(nullptr)); });
+		}
+		return *p;
+	}
+
+	/**
+	 * Stores value only when key is missing or value is greater than the currently stored value.
+	 * Returns true when the map was updated. If pOutFinalValue is provided, it receives the value that
+	 * remains stored for key after this call, regardless of whether the map was updated.
+	 */
+	bool setIfGreater(K const& key, V value, V* pOutFinalValue = nullptr) {
+		size_t h = hashOf(key);
+		auto &s = shardFor(h);
+		std::lock_guard<std::mutex> lk(s.mutex);
+		bool inserted;
+		V* p = s.table.findOrInsert(key, h, inserted, [&] { return std::move(value); });
+		bool updated = inserted;
+		if (!inserted && value > *p) {
+			*p = std::move(value);
+			updated = true;
+		}
+		if (pOutFinalValue)
+			*pOutFinalValue = *p;
+		return updated;
+	}
+
+	// copies the value for key into out; returns false if there is none
+	bool get(K const& key, V &out) const {
+		size_t h = hashOf(key);
+		auto &s = shardFor(h);
+		std::lock_guard<std::mutex> lk(s.mutex);
+		V* p = s.table.find(key, h);
+		if (!p)
+			return false;
+		out = *p;
+		return true;
+	}
+
+	bool contains(K const& key) const {
+		size_t h = hashOf(key);
+		auto &s = shardFor(h);
+		std::lock_guard<std::mutex> lk(s.mutex);
+		return s.table.find(key, h) != nullptr;
+	}
+
+	// returns true if the key was present
+	bool erase(K const& key) {
+		size_t h = hashOf(key);
+		auto &s = shardFor(h);
+		std::lock_guard<std::mutex> lk(s.mutex);
+		return s.table.erase(key, h);
+	}
+
+	// thread safe-ish (the shards are summed up one at a time, so the result may be stale if other threads are writing)
+	size_t size() const {
+		size_t n = 0;
+		for (size_t i=0; i<shardCountPow2(); i++) {
+			std::lock_guard<std::mutex> lk(shards_[i].mutex);
+			n += shards_[i].table.size();
+		}
+		return n;
+	}
+
+	// calls f(key, value) for every entry, locking one shard at a time; don't access the map from f
+	template<class F>
+	void forEach(F f) const {
+		for (size_t i=0; i<shardCountPow2(); i++) {
+			std::lock_guard<std::mutex> lk(shards_[i].mutex);
+			shards_[i].table.forEach(f);
+		}
+	}
+
+	void clear() {
+		for (size_t i=0; i<shardCountPow2(); i++) {
+			std::lock_guard<std::mutex> lk(shards_[i].mutex);
+			shards_[i].table.clear();
+		}
+	}
+
+private:
+	// single-threaded open-addressing table with linear probing and backward-shift deletion
+	class flatTable {
+	public:
+		flatTable() = default;
+		flatTable(flatTable const&) = delete;
+		flatTable& operator=(flatTable const&) = delete;
+
+		~flatTable() {
+			clear();
+		}
+
+		size_t size() const { return size_; }
+
+		void reserve(size_t n) {
+			size_t cap = minCapacity;
+			while (cap * maxLoadNum < n * maxLoadDen)
+				cap <<= 1;
+			if (cap > capacity_)
+				rehash(cap);
+		}
+
+		V* find(K const& key, size_t h) const {
+			size_t i = findIndex(key, h);
+			return i < capacity_ ? &slots_[i].entry()->second : nullptr;
+		}
+
+		template<class MakeValue>
+		V* findOrInsert(K const& key, size_t h, bool &inserted, MakeValue makeValue) {
+			if (V* p = find(key, h)) {
+				inserted = false;
+				return p;
+			}
+			if ((size_ + 1) * maxLoadDen > capacity_ * maxLoadNum)
+				rehash(capacity_ ? capacity_ * 2 : minCapacity);
+			size_t i = h & mask();
+			while (ctrl_[i] != emptyTag)
+				i = (i + 1) & mask();
+			new (slots_[i].storage) std::pair<K, V>(key, makeValue());
+			ctrl_[i] = tagOf(h);
+			hashes_[i] = h;
+			size_++;
+			inserted = true;
+			return &slots_[i].entry()->second;
+		}
+
+		bool erase(K const& key, size_t h) {
+			size_t i = findIndex(key, h);
+			if (i == capacity_)
+				return false;
+			slots_[i].entry()->~pair();
+			ctrl_[i] = emptyTag;
+			size_--;
+			// shift back the following entries of the cluster that would otherwise become unreachable
+			for (size_t j = (i + 1) & mask(); ctrl_[j] != emptyTag; j = (j + 1) & mask()) {
+				size_t home = hashes_[j] & mask();
+				// entry j may stay if its home slot lies cyclically in (i, j]
+				bool stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+				if (stays)
+					continue;
+				new (slots_[i].storage) std::pair<K, V>(std::move(*slots_[j].entry()));
+				slots_[j].entry()->~pair();
+				ctrl_[i] = ctrl_[j];
+				hashes_[i] = hashes_[j];
+				ctrl_[j] = emptyTag;
+				i = j;
+			}
+			return true;
+		}
+
+		template<class F>
+		void forEach(F &f) const {
+			for (size_t i=0; i<capacity_; i++)
+				if (ctrl_[i] != emptyTag)
+					f(slots_[i].entry()->first, slots_[i].entry()->second);
+		}
+
+		void clear() {
+			for (size_t i=0; i<capacity_; i++)
+				if (ctrl_[i] != emptyTag) {
+					slots_[i].entry()->~pair();
+					ctrl_[i] = emptyTag;
+				}
+			size_ = 0;
+		}
+
+	private:
+		static constexpr uint8_t emptyTag = 0;
+		static constexpr size_t minCapacity = 8;
+		static constexpr size_t maxLoadNum = 3, maxLoadDen = 4;	// grow beyond 75% occupancy
+
+		struct slot {
+			alignas(std::pair<K, V>) unsigned char storage[sizeof(std::pair<K, V>)];
+			std::pair<K, V>* entry() { return reinterpret_cast<std::pair<K, V>*>(storage); }
+		};
+
+		std::unique_ptr<uint8_t[]> ctrl_;	// emptyTag or 0x80 | 7 bits of the hash, checked before comparing keys
+		std::unique_ptr<size_t[]> hashes_;	// full hashes, so that rehashing and erasing don't have to call Hash again
+		std::unique_ptr<slot[]> slots_;
+		size_t capacity_ = 0;
+		size_t size_ = 0;
+
+		size_t mask() const { return capacity_ - 1; }
+
+		// bits 32..38 of the hash: above the bits that pick the slot (for any sane shard size), below the ones that pick the shard
+		static uint8_t tagOf(size_t h) {
+			return 0x80 | uint8_t((uint64_t(h) >> 32) & 0x7f);
+		}
+
+		// returns capacity_ if the key isn't there
+		size_t findIndex(K const& key, size_t h) const {
+			if (!capacity_)
+				return 0;
+			uint8_t tag = tagOf(h);
+			for (size_t i = h & mask(); ctrl_[i] != emptyTag; i = (i + 1) & mask())
+				if (ctrl_[i] == tag && slots_[i].entry()->first == key)
+					return i;
+			return capacity_;
+		}
+
+		void rehash(size_t newCapacity) {
+			std::unique_ptr<uint8_t[]> ctrl(new uint8_t[newCapacity]);
+			std::memset(ctrl.get(), emptyTag, newCapacity);
+			std::unique_ptr<size_t[]> hashes(new size_t[newCapacity]);
+			std::unique_ptr<slot[]> slots(new slot[newCapacity]);
+			size_t newMask = newCapacity - 1;
+			for (size_t i=0; i<capacity_; i++) {
+				if (ctrl_[i] == emptyTag)
+					continue;
+				size_t j = hashes_[i] & newMask;
+				while (ctrl[j] != emptyTag)
+					j = (j + 1) & newMask;
+				new (slots[j].storage) std::pair<K, V>(std::move(*slots_[i].entry()));
+				slots_[i].entry()->~pair();
+				ctrl[j] = ctrl_[i];
+				hashes[j] = hashes_[i];
+			}
+			ctrl_ = std::move(ctrl);
+			hashes_ = std::move(hashes);
+			slots_ = std::move(slots);
+			capacity_ = newCapacity;
+		}
+	};
+
+	struct alignas(64) shard {
+		mutable std::mutex mutex;
+		flatTable table;
+	};
+
+	std::unique_ptr<shard[]> shards_;
+	unsigned shardBits_;
+	Hash hash_;
+
+	size_t shardCountPow2() const { return size_t(1) << shardBits_; }
+
+	// std::hash is often the identity for integers; mix the bits so that all the parts of the hash used below are good
+	size_t hashOf(K const& key) const {
+		uint64_t h = hash_(key);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		return size_t(h);
+	}
+
+	// the shard is picked by the top bits of the hash, the slot inside the shard by the bottom bits
+	shard& shardFor(size_t h) const {
+		return shardBits_ ? shards_[h >> (sizeof(size_t) * 8 - shardBits_)] : shards_[0];
+	}
+};
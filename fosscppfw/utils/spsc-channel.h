@@ -0,0 +1,169 @@
+/*
+ * spsc-channel.h
+ *
+ *  Bounded single-producer / single-consumer ring channel.
+ *  Exactly one thread may push and exactly one (other) thread may pop; in exchange all non-blocking operations
+ *  are wait-free and touch no shared cache line other than the two position counters, each on its own line.
+ *  Each side keeps a cached copy of the other side's position and only re-reads it when the cache says full / empty.
+ *
+ *  Zero-copy usage:
+ *		producer:	if (void* slot = ch.reserve()) { new (slot) Payload(args...); ch.commit(); }
+ *		consumer:	if (Payload* p = ch.peek()) { use(*p); ch.consume(); }
+ *
+ *  The blocking push() / pop() spin briefly and then park (see parking-lot.h), only when the channel is full / empty.
+ */
+#pragma once
+
+#include "parking-lot.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+template<class T>
+class SPSCChannel {
+public:
+	// capacity is rounded up to the next power of two
+	explicit SPSCChannel(size_t capacity) {
+		if (capacity == 0)
+			throw std::invalid_argument("SPSCChannel capacity must not be zero");
+		size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		mask_ = size - 1;
+		slots_.reset(new slot[size]);
+	}
+
+	SPSCChannel(SPSCChannel const&) = delete;
+	SPSCChannel& operator=(SPSCChannel const&) = delete;
+
+	~SPSCChannel() {
+		while (peek())
+			consume();
+	}
+
+	size_t capacity() const { return mask_ + 1; }
+
+	// ---------- producer side ----------
+
+	// Returns uninitialized storage for the next element, or nullptr if the channel is full.
+	// Construct a T in it with placement new, then call commit() to publish it.
+	void* reserve() {
+		size_t pos = tail_.load(std::memory_order_relaxed);
+		if (pos - cachedHead_ > mask_) {
+			cachedHead_ = head_.load(std::memory_order_acquire);
+			if (pos - cachedHead_ > mask_)
+				return nullptr;
+		}
+		return slots_[pos & mask_].storage;
+	}
+
+	// publishes the element constructed in the slot returned by the last reserve()
+	void commit() {
+		tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		wake(consumerWaiting_, tail_);
+	}
+
+	template<class... Args>
+	bool try_emplace(Args&&... args) {
+		void* p = reserve();
+		if (!p)
+			return false;
+		new (p) T(std::forward<Args>(args)...);
+		commit();
+		return true;
+	}
+
+	bool try_push(T &&t) {
+		return try_emplace(std::move(t));
+	}
+
+	// blocks while the channel is full
+	template<class... Args>
+	void emplace(Args&&... args) {
+		void* p;
+		while (!(p = reserve()))
+			waitWhileUnchanged(head_, cachedHead_, producerWaiting_);
+		new (p) T(std::forward<Args>(args)...);
+		commit();
+	}
+
+	void push(T &&t) {
+		emplace(std::move(t));
+	}
+
+	// ---------- consumer side ----------
+
+	// returns the oldest element without removing it, or nullptr if the channel is empty
+	T* peek() {
+		size_t pos = head_.load(std::memory_order_relaxed);
+		if (pos == cachedTail_) {
+			cachedTail_ = tail_.load(std::memory_order_acquire);
+			if (pos == cachedTail_)
+				return nullptr;
+		}
+		return reinterpret_cast<T*>(slots_[pos & mask_].storage);
+	}
+
+	// destroys the element returned by peek() and frees its slot
+	void consume() {
+		size_t pos = head_.load(std::memory_order_relaxed);
+		reinterpret_cast<T*>(slots_[pos & mask_].storage)->~T();
+		head_.store(pos + 1, std::memory_order_release);
+		wake(producerWaiting_, head_);
+	}
+
+	bool try_pop(T &out) {
+		T* p = peek();
+		if (!p)
+			return false;
+		out = std::move(*p);
+		consume();
+		return true;
+	}
+
+	// blocks while the channel is empty
+	T pop() {
+		T* p;
+		while (!(p = peek()))
+			waitWhileUnchanged(tail_, cachedTail_, consumerWaiting_);
+		T t(std::move(*p));
+		consume();
+		return t;
+	}
+
+private:
+	struct slot {
+		alignas(T) unsigned char storage[sizeof(T)];
+	};
+
+	// parks until the other side moves its position away from the value we have cached
+	void waitWhileUnchanged(std::atomic<size_t> const& position, size_t cached, std::atomic<bool> &waiting) {
+		// seq_cst pairs with the fence in wake(): either the other side sees the flag, or we see its new position
+		waiting.store(true, std::memory_order_seq_cst);
+		parking::waitWhileEqual(position, cached);
+		waiting.store(false, std::memory_order_relaxed);
+	}
+
+	void wake(std::atomic<bool> &waiting, std::atomic<size_t> const& position) {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting.load(std::memory_order_relaxed))
+			parking::notifyAll(&position);
+	}
+
+	std::unique_ptr<slot[]> slots_;
+	size_t mask_;
+
+	alignas(64) std::atomic<size_t> head_ { 0 };	// next position to read, written by the consumer
+	size_t cachedTail_ = 0;	// consumer's copy of tail_
+
+	alignas(64) std::atomic<size_t> tail_ { 0 };	// next position to write, written by the producer
+	size_t cachedHead_ = 0;	// producer's copy of head_
+
+	// read by the other side on every operation but rarely written, so they get a line of their own
+	alignas(64) std::atomic<bool> consumerWaiting_ { false };
+	std::atomic<bool> producerWaiting_ { false };
+};
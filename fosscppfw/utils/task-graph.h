@@ -0,0 +1,63 @@
+/*
+ * task-graph.h
+ *
+ *  A small builder for dependency graphs of pool tasks.
+ *  Each node is scheduled into the pool as soon as all of its predecessors have finished,
+ *  without any thread blocking in the meantime (see ThreadPool::queueAfter()).
+ *
+ *  Usage:
+ *		TaskGraph g;
+ *		auto load = g.add([] { ... });
+ *		auto parseA = g.add([] { ... }, { load });
+ *		auto parseB = g.add([] { ... }, { load });
+ *		g.add([] { ... }, { parseA, parseB });
+ *		g.run(pool)->wait();
+ */
+#pragma once
+
+#include "ThreadPool.h"
+
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+class TaskGraph {
+public:
+	using node = size_t;
+
+	// adds a node that runs after all the given nodes have finished.
+	// Predecessors must have been added before, which makes cycles impossible by construction.
+	node add(std::function<void()> work, std::vector<node> const& predecessors = {}) {
+		for (node p : predecessors)
+			if (p >= nodes_.size())
+				throw std::invalid_argument("TaskGraph: predecessor node does not exist (yet)");
+		nodes_.push_back({ std::move(work), predecessors });
+		return nodes_.size() - 1;
+	}
+
+	size_t size() const { return nodes_.size(); }
+
+	// schedules the whole graph into the pool and returns a task that finishes when all the nodes have finished.
+	// The graph is left untouched and can be run again.
+	PoolTaskHandle run(ThreadPool &pool) const {
+		std::vector<PoolTaskHandle> tasks;
+		tasks.reserve(nodes_.size());
+		std::vector<PoolTaskHandle> preds;
+		for (auto &n : nodes_) {
+			preds.clear();
+			for (node p : n.predecessors)
+				preds.push_back(tasks[p]);
+			tasks.push_back(preds.empty()
+				? pool.queueTask(n.work)
+				: pool.queueAfter(preds, n.work));
+		}
+		return PoolTask::whenAll(std::move(tasks));
+	}
+
+private:
+	struct nodeData {
+		std::function<void()> work;
+		std::vector<node> predecessors;
+	};
+	std::vector<nodeData> nodes_;
+};
@@ -0,0 +1,117 @@
+/*
+ * work-stealing-deque.h
+ *
+ *  Lock-free work-stealing deque (Chase-Lev), as described in
+ *  "Correct and Efficient Work-Stealing for Weak Memory Models" (Le, Pop, Cohen, Zappa Nardelli, 2013).
+ *
+ *  The owner thread pushes and pops at the bottom end (LIFO), any other thread may steal from the top end (FIFO).
+ *  T must be a trivially copyable type (typically a raw pointer); an empty result is signaled by returning T{}.
+ */
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+
+template<class T>
+class WorkStealingDeque {
+	static_assert(std::is_trivially_copyable<T>::value, "WorkStealingDeque only holds trivially copyable values (use pointers)");
+public:
+	explicit WorkStealingDeque(size_t initialCapacity = 256) {
+		size_t cap = 1;
+		while (cap < initialCapacity)
+			cap <<= 1;
+		arrays_.emplace_back(new ringArray(cap));
+		array_.store(arrays_.back().get(), std::memory_order_relaxed);
+	}
+
+	WorkStealingDeque(WorkStealingDeque const&) = delete;
+	WorkStealingDeque& operator=(WorkStealingDeque const&) = delete;
+
+	// owner thread only
+	void push(T value) {
+		int64_t b = bottom_.load(std::memory_order_relaxed);
+		int64_t t = top_.load(std::memory_order_acquire);
+		ringArray* a = array_.load(std::memory_order_relaxed);
+		if (b - t > (int64_t)a->capacity - 1)
+			a = grow(a, t, b);
+		a->put(b, value);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom_.store(b + 1, std::memory_order_relaxed);
+	}
+
+	// owner thread only - returns T{} if the deque is empty
+	T pop() {
+		int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+		ringArray* a = array_.load(std::memory_order_relaxed);
+		bottom_.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top_.load(std::memory_order_relaxed);
+		if (t > b) {
+			// deque was empty
+			bottom_.store(b + 1, std::memory_order_relaxed);
+			return T{};
+		}
+		T value = a->get(b);
+		if (t == b) {
+			// last element - race against thieves
+			if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+				value = T{};
+			bottom_.store(b + 1, std::memory_order_relaxed);
+		}
+		return value;
+	}
+
+	// any thread - returns T{} if the deque is empty or the steal lost a race
+	T steal() {
+		int64_t t = top_.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom_.load(std::memory_order_acquire);
+		if (t >= b)
+			return T{};
+		ringArray* a = array_.load(std::memory_order_acquire);
+		T value = a->get(t);
+		if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return T{};
+		return value;
+	}
+
+	// any thread - may return a non-up-to-date value
+	size_t size() const {
+		int64_t b = bottom_.load(std::memory_order_relaxed);
+		int64_t t = top_.load(std::memory_order_relaxed);
+		return b > t ? b - t : 0;
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+private:
+	struct ringArray {
+		const size_t capacity;
+		std::unique_ptr<std::atomic<T>[]> buf;
+
+		explicit ringArray(size_t cap) : capacity(cap), buf(new std::atomic<T>[cap]) {}
+
+		T get(int64_t i) const { return buf[i & (capacity - 1)].load(std::memory_order_relaxed); }
+		void put(int64_t i, T v) { buf[i & (capacity - 1)].store(v, std::memory_order_relaxed); }
+	};
+
+	ringArray* grow(ringArray* a, int64_t t, int64_t b) {
+		// old arrays are kept alive until destruction because thieves may still be reading from them
+		arrays_.emplace_back(new ringArray(a->capacity * 2));
+		ringArray* n = arrays_.back().get();
+		for (int64_t i = t; i < b; i++)
+			n->put(i, a->get(i));
+		array_.store(n, std::memory_order_release);
+		return n;
+	}
+
+	alignas(64) std::atomic<int64_t> top_ { 0 };
+	alignas(64) std::atomic<int64_t> bottom_ { 0 };
+	std::atomic<ringArray*> array_ { nullptr };
+	std::vector<std::unique_ptr<ringArray>> arrays_; // owned by the owner thread
+};